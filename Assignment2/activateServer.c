@@ -0,0 +1,22 @@
+#include<stdio.h>
+#include<stdlib.h>
+#include<sys/types.h>
+#include<sys/socket.h>
+
+#include "activation.h"
+#include "upperEcho.h"
+
+// Example 'activate' service: accepts connections on the socket passed by
+// the superserver and echoes back in uppercase, until the client sends "exit".
+int main(int argc, char **argv) {
+	if (activation_listen_fds() < 1) {
+		fprintf(stderr, "No socket passed: run in 'activate' mode\n");
+		return EXIT_FAILURE;
+	}
+	int socketFD;
+	while ((socketFD = accept(ACTIVATION_FIRST_FD, NULL, NULL)) >= 0) {
+		upper_echo_connection(socketFD);
+	}
+	perror("accept");
+	return EXIT_FAILURE;
+}
@@ -0,0 +1,26 @@
+#ifndef ACTIVATION_H
+#define ACTIVATION_H
+
+#include <stdlib.h>
+#include <unistd.h>
+
+// Helpers for services started by the superserver in 'activate' mode.
+// An activated service is started once and receives the service socket on
+// fd 3; it accepts (or receives) by itself and is restarted when it exits.
+// The handoff follows the LISTEN_FDS convention, so the same binary can also
+// be started by other socket-activation supervisors.
+
+#define ACTIVATION_FIRST_FD 3
+
+// Returns the number of sockets passed starting from ACTIVATION_FIRST_FD,
+// 0 if the service was not started by socket activation.
+int activation_listen_fds() {
+	const char *pid = getenv("LISTEN_PID");
+	const char *fds = getenv("LISTEN_FDS");
+	if (pid == NULL || fds == NULL || atoi(pid) != getpid())
+		return 0; // Meant for another process
+	int count = atoi(fds);
+	return count < 0 ? 0 : count;
+}
+
+#endif
@@ -0,0 +1,112 @@
+#!/usr/bin/env python3
+# Measures how the dispatcher of the superserver scales with the number of
+# configured services: the time from a connection attempt to the first byte
+# written by the child forked for it (wakeup, dispatch, fork and exec).
+#
+# Every configuration has one measured service, '/bin/date' in 'nowait' mode,
+# plus idle 'internal:discard' services up to the requested count (internal
+# services do not keep the binary open, so 1000 of them fit the select
+# dispatcher). Exec costs the same with every build: the differences between
+# builds come from the dispatcher.
+#
+# With --spawn the builds are compared on how they spawn children instead:
+# only the measured service is configured, and the memory of each superserver
+# is printed. Fork copies the page tables of a large superserver, vfork does
+# not, so the builds are grown with BENCH_RSS_MB (in MB) to make it visible.
+#
+# Usage, from this directory (results of a run are in bench-dispatch.txt):
+#   make release select uring
+#   ./bench-dispatch.py ./superserver ./superserver-select ./superserver-uring
+#   make clean && make release forkexec CFLAGS="-Wall -pedantic -DBENCH_RSS_MB=1024"
+#   ./bench-dispatch.py --spawn ./superserver ./superserver-forkexec
+# Options: --services 10,100,1000 --connections 500 --port 20000 (every run
+# uses new ports from there: keep them below the ephemeral range, 32768)
+
+import argparse
+import os
+import socket
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+
+
+def write_configuration(directory, services, port):
+    with open(os.path.join(directory, "conf.txt"), "w") as conf:
+        conf.write("/bin/date tcp %d nowait\n" % port)
+        for i in range(1, services):
+            conf.write("internal:discard tcp %d nowait\n" % (port + i))
+
+
+def wait_for_port(port, process):
+    for _ in range(500):
+        if process.poll() is not None:
+            sys.exit("The superserver exited with code %d" % process.returncode)
+        try:
+            socket.create_connection(("127.0.0.1", port)).close()
+            return
+        except ConnectionRefusedError:
+            time.sleep(0.01)
+    sys.exit("The superserver is not listening on port %d" % port)
+
+
+# Returns the microseconds from connect to the first byte of the answer
+def measure_connection(port):
+    start = time.perf_counter()
+    with socket.create_connection(("127.0.0.1", port)) as connection:
+        if not connection.recv(64):
+            sys.exit("The measured service closed without answering")
+        return (time.perf_counter() - start) * 1e6
+
+
+# Returns the resident memory of a process, in MB
+def resident_memory(process):
+    with open("/proc/%d/status" % process.pid) as status:
+        for line in status:
+            if line.startswith("VmRSS:"):
+                return int(line.split()[1]) / 1024
+    return 0
+
+
+def measure(superserver, services, connections, port):
+    with tempfile.TemporaryDirectory() as directory:
+        write_configuration(directory, services, port)
+        process = subprocess.Popen([os.path.abspath(superserver)], cwd=directory,
+            stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        try:
+            wait_for_port(port, process)
+            for _ in range(connections // 10): # Warm up
+                measure_connection(port)
+            samples = sorted(measure_connection(port) for _ in range(connections))
+            memory = resident_memory(process)
+        finally:
+            process.terminate()
+            process.wait()
+    return samples, memory
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Wakeup-to-fork latency of superserver builds")
+    parser.add_argument("superservers", nargs="+", help="superserver binaries to compare")
+    parser.add_argument("--services", default="10,100,1000", help="comma-separated service counts")
+    parser.add_argument("--connections", type=int, default=500, help="measured connections per run")
+    parser.add_argument("--port", type=int, default=20000, help="first port used by the services")
+    parser.add_argument("--spawn", action="store_true", help="compare how the builds spawn children")
+    args = parser.parse_args()
+    if args.spawn:
+        args.services = "1"
+
+    print("%-24s %8s %8s %10s %10s %10s" % ("build", "services", "RSS MB", "median us", "p90 us", "p99 us"))
+    for services in [int(count) for count in args.services.split(",")]:
+        for superserver in args.superservers:
+            samples, memory = measure(superserver, services, args.connections, args.port)
+            print("%-24s %8d %8.0f %10.1f %10.1f %10.1f" % (os.path.basename(superserver), services, memory,
+                statistics.median(samples), samples[len(samples) * 9 // 10], samples[len(samples) * 99 // 100]))
+            # The sockets of a terminated io_uring build may outlive it for a
+            # moment, while the ring is torn down: every run uses new ports
+            args.port += services
+
+
+if __name__ == "__main__":
+    main()
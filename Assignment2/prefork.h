@@ -0,0 +1,44 @@
+#ifndef PREFORK_H
+#define PREFORK_H
+
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+// Helpers for services started by the superserver in 'prefork' mode.
+// A prefork worker is started once and receives on fd 0 the Unix-domain
+// socket used by the superserver to hand it accepted connections. The
+// superserver only hands a connection to a worker which asked for one.
+
+#define PREFORK_CHANNEL_FD 0
+
+// Tells the superserver that the worker is idle, then waits for the next
+// connection it hands over.
+// Returns the connected socket, or -1 if the superserver closed the channel.
+int prefork_receive_connection() {
+	char dummy = 0;
+	if (send(PREFORK_CHANNEL_FD, &dummy, 1, MSG_NOSIGNAL) < 0)
+		return -1;
+	struct iovec iov = { .iov_base = &dummy, .iov_len = 1 };
+	union { // Properly aligned buffer for the control message
+		char buffer[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buffer;
+	msg.msg_controllen = sizeof(control.buffer);
+
+	if (recvmsg(PREFORK_CHANNEL_FD, &msg, 0) <= 0)
+		return -1;
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+		return -1;
+	int fd;
+	memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+	return fd;
+}
+
+#endif
@@ -0,0 +1,15 @@
+#include<stdio.h>
+#include<stdlib.h>
+
+#include "prefork.h"
+#include "upperEcho.h"
+
+// Example 'prefork' service: echoes back in uppercase every connection
+// handed over by the superserver, until the client sends "exit".
+int main(int argc, char **argv) {
+	int socketFD;
+	while ((socketFD = prefork_receive_connection()) >= 0) {
+		upper_echo_connection(socketFD);
+	}
+	return 0;
+}
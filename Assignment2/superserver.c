@@ -1,20 +1,40 @@
+#define _GNU_SOURCE
 #include<stdio.h>
 #include<string.h>
 #include<stdlib.h>
 #include<sys/types.h>
 #include<sys/socket.h>
+#include<sys/un.h>
 #include<sys/time.h>
 #include<sys/wait.h>
+#include<sys/signalfd.h>
+#include<sys/timerfd.h>
+#include<sys/mman.h>
+#include<sys/prctl.h>
+#include<sched.h>
 #include<netinet/in.h>
+#include<netinet/tcp.h>
 #include<signal.h>
 #include<errno.h>
 #include<stdbool.h>
 #include<ctype.h>
 #include<unistd.h>
+#include<fcntl.h>
+#include<time.h>
+#include<stdint.h>
+#ifdef USE_SELECT
+#include<sys/select.h>
+#elif defined(USE_IO_URING)
+#include<poll.h>
+#include<sys/syscall.h>
+#include<linux/io_uring.h>
+#else
+#include<sys/epoll.h>
+#endif
 
 // Buffer sizes
 #define PROTOCOL_TYPE_SIZE 4
-#define SERVICE_MODE_SIZE 7
+#define SERVICE_MODE_SIZE 9
 #define PORT_NUMBER_SIZE 6
 #define MAX_NAME_SIZE 256
 #define MAX_LINE_SIZE (MAX_NAME_SIZE + PORT_NUMBER_SIZE + PROTOCOL_TYPE_SIZE + SERVICE_MODE_SIZE + 20)
@@ -34,23 +54,150 @@
 #define CHILD_EXIT_EXECLE_ERROR 21
 #define CHILD_EXIT_CLOSE_ERROR 22
 #define CHILD_EXIT_DUP_ERROR 23
+#define EXIT_EPOLL_ERROR 24
+#define EXIT_TOO_MANY_SOCKETS_ERROR 25
+#define EXIT_SOCKETPAIR_ERROR 26
+#define EXIT_SIGNAL_ERROR 27
+#define EXIT_SOCKET_OPTION_ERROR 28
+#define EXIT_USAGE_ERROR 29
+#define EXIT_SHARED_MEMORY_ERROR 30
+#define EXIT_IO_URING_ERROR 31
+#define EXIT_TIMER_ERROR 32
 // Constants
 #define PROTOCOL_UDP "udp"
 #define PROTOCOL_TCP "tcp"
 #define MODE_WAIT "wait"
 #define MODE_NOWAIT "nowait"
+#define MODE_PREFORK "prefork"
+#define MODE_ACTIVATE "activate"
+#define LISTEN_FDS_START 3
+#define MAX_PREFORK_WORKERS 1024
+#define MAX_DISPATCHERS 1024
+#define WORKERS_OPTION "--workers"
 #define PORT_MAX 65535
-#define MAX_TCP_PENDING_CONNECTIONS 8
+#define DEFAULT_TCP_BACKLOG 128
+#define MAX_TCP_BACKLOG 65535
+#define OPTION_BACKLOG "backlog"
+#define OPTION_MAX_CHILDREN "max_children"
+#define OPTION_MAX_RATE "max_rate"
+#define NETSTAT_FILE_NAME "/proc/net/netstat"
+#define FORK_LATENCY_BUCKETS 16
+#define EXIT_CODES_COUNT 256
 #define SUPERSERVER_CONF_FILE_NAME "conf.txt"
+#define MAX_READY_SOURCES 64
+#define URING_ENTRIES 256
+#define INTERNAL_PREFIX "internal:"
+#define INTERNAL_BUFFER_SIZE 4096
+#define INTERNAL_DATAGRAMS_PER_WAKEUP 64
+#define CHARGEN_LINE_LENGTH 72
+#define CHARGEN_MAX_DATAGRAM_SIZE 512
+#define UDP_REQUESTS_PER_WAKEUP 64
+#define MAX_DATAGRAM_SIZE 65536
+#define WORKER_MIN_UPTIME_SECONDS 5 // A worker dying sooner is a fast failure
+#define RESPAWN_WINDOW_SECONDS 60 // Fast failures are counted within this window
+#define RESPAWN_MAX_FAST_FAILURES 8 // The service is given up when reached
+#define RESPAWN_MIN_DELAY_MS 100 // Delay after the first fast failure, doubled by each one
+#define RESPAWN_MAX_DELAY_MS 5000
+#define ACCEPT_BACKOFF_MS 100 // A service out of descriptors or memory stops accepting this long
 
+// Accept statistics of a TCP service
 typedef struct {
+	unsigned long wakeups;     // Readiness events handled
+	unsigned long connections; // Connections accepted
+	unsigned long maxBatch;    // Most connections accepted in a single wakeup
+	unsigned long maxQueued;   // Longest accept queue observed
+	unsigned long queueFull;   // Wakeups finding the accept queue full: SYNs may have been dropped
+} AcceptStats;
+
+// Statistics about the children spawned for a service
+typedef struct {
+	unsigned long forks;
+	// Bucket i counts forks which took less than 2^i microseconds (the last one all the others)
+	unsigned long forkLatency[FORK_LATENCY_BUCKETS];
+	unsigned long execFailures; // Children exited with CHILD_EXIT_EXECLE_ERROR
+	unsigned long killed; // Children terminated by a signal
+	unsigned long exitCodes[EXIT_CODES_COUNT];
+	unsigned long deferrals; // Times the socket stopped being watched
+	double deferredSeconds; // Time spent not watching the socket
+	struct timespec deferredSince; // Start of the current deferral
+} ChildStats;
+
+// Children of a service which are still running
+typedef struct {
+	int count;
+	int capacity;
+	pid_t *pids;
+} ChildTable;
+
+// Every structure watched by the dispatcher starts with its source type,
+// so that the main loop can tell what became ready
+typedef enum {
+	SOURCE_SERVICE,
+	SOURCE_SIGNAL,
+	SOURCE_TIMER,
+	SOURCE_RESUME_TIMER,
+	SOURCE_WORKER,
+	SOURCE_CONNECTION
+} SourceType;
+
+// A persistent worker of a 'prefork' service
+typedef struct {
+	SourceType sourceType; // Always SOURCE_WORKER
+	struct ServiceData *service;
+	pid_t pid;      // 0 if the worker is not running
+	int channelFD;  // Unix-domain socket used to hand connections to the worker
+	bool idle;      // Waiting for a connection (it said so on its channel)
+	struct timespec startTime;
+	bool respawnPending; // Dead, waiting for `respawnTime` to be started again
+	struct timespec respawnTime;
+} PreforkWorker;
+
+// Services run inside the superserver, selected with 'internal:<name>' as path
+typedef enum {
+	INTERNAL_NONE, // The service is an executable
+	INTERNAL_ECHO,
+	INTERNAL_UPPER,
+	INTERNAL_DISCARD,
+	INTERNAL_CHARGEN,
+	INTERNAL_DAYTIME,
+	INTERNAL_STATS // Reports the statistics of every service (TCP only)
+} InternalType;
+
+// Names of the internal services, indexed by InternalType
+const char *internalServiceNames[] = { NULL, "echo", "upper", "discard", "chargen", "daytime", "stats" };
+#define INTERNAL_TYPES_COUNT (sizeof(internalServiceNames) / sizeof(internalServiceNames[0]))
+
+typedef struct ServiceData {
+	SourceType sourceType; // Always SOURCE_SERVICE
 	char protocol[PROTOCOL_TYPE_SIZE]; // 'tcp', 'udp'
-	char mode[SERVICE_MODE_SIZE]; // 'wait', 'nowait'
+	char mode[SERVICE_MODE_SIZE]; // 'wait', 'nowait', 'prefork', 'activate'
 	char port[PORT_NUMBER_SIZE];
 	char path[MAX_NAME_SIZE]; // service path
 	char name[MAX_NAME_SIZE]; // service name
 	int  socketFD;
-	int  pid; // child process ID: only meaningful if type is 'wait'
+	int  binaryFD; // O_PATH descriptor of the binary, -1 if it could not be opened
+	InternalType internal; // INTERNAL_NONE unless the service runs in the superserver
+	int  maxChildren; // maximum number of running children, 0 if unlimited
+	int  maxRate; // maximum requests per second, 0 if unlimited
+	bool deferred; // over its limits: the socket is not watched
+	bool acceptPaused; // out of descriptors or memory: not accepting until acceptPausedUntil
+	struct timespec acceptPausedUntil;
+	bool resumeQueued; // deferred until resumeTime, in resumeQueue
+	struct timespec resumeTime;
+	struct ServiceData *nextResume; // next service in resumeQueue
+	struct timespec rateWindowStart; // start of the current one-second rate window
+	int  rateCount; // requests in the current rate window
+	int  workerCount; // number of workers: only meaningful if type is 'prefork' (1 for 'activate')
+	int  nextWorker; // worker receiving the next connection
+	int  idleWorkers;
+	PreforkWorker *workers;
+	int  fastFailures; // workers died soon after starting, in the current window
+	struct timespec failureWindowStart;
+	bool gaveUp; // too many fast failures: dead workers are not started again
+	int  backlog; // length of the accept queue: only meaningful if protocol is 'tcp'
+	AcceptStats acceptStats;
+	ChildTable children;
+	ChildStats *childStats;
 } ServiceData;
 
 typedef struct {
@@ -58,6 +205,26 @@ typedef struct {
 	ServiceData *services;
 } ServiceDataVector;
 
+// A dispatcher process started with --workers; lives in memory shared with the master
+typedef struct {
+	pid_t pid;
+	int cpu; // CPU the dispatcher is pinned to
+	unsigned long accepts; // Connections accepted and datagrams handled
+} DispatcherProcess;
+
+// A TCP connection served by an internal service
+typedef struct {
+	SourceType sourceType; // Always SOURCE_CONNECTION
+	int socketFD;
+	InternalType internal;
+	char *output; // Either `buffer` or an allocated report
+	size_t pendingStart; // Output waiting for the socket to be writable
+	size_t pendingEnd;
+	bool closeWhenFlushed;
+	int chargenOffset; // First character of the next chargen line
+	char buffer[INTERNAL_BUFFER_SIZE];
+} InternalConnection;
+
 // Prints a custom error
 void print_error(int error) {
 	switch(error) {
@@ -103,6 +270,33 @@ void print_error(int error) {
 		case CHILD_EXIT_DUP_ERROR:
 			fprintf(stderr, "The dup operation returned an error");
 			break;
+		case EXIT_EPOLL_ERROR:
+			perror("The epoll operation returned an error");
+			break;
+		case EXIT_TOO_MANY_SOCKETS_ERROR:
+			fprintf(stderr, "Too many sockets for the select dispatcher (FD_SETSIZE is %d)\n", FD_SETSIZE);
+			break;
+		case EXIT_SOCKETPAIR_ERROR:
+			perror("The creation of the worker channel was unsuccesful");
+			break;
+		case EXIT_SIGNAL_ERROR:
+			perror("The signal handling setup returned an error");
+			break;
+		case EXIT_SOCKET_OPTION_ERROR:
+			perror("Cannot set the socket options");
+			break;
+		case EXIT_USAGE_ERROR:
+			fprintf(stderr, "Usage: superserver [%s N]\n", WORKERS_OPTION);
+			break;
+		case EXIT_SHARED_MEMORY_ERROR:
+			perror("Cannot allocate the shared counters");
+			break;
+		case EXIT_IO_URING_ERROR:
+			perror("The io_uring operation returned an error");
+			break;
+		case EXIT_TIMER_ERROR:
+			perror("The timer operation returned an error");
+			break;
 	}
 }
 
@@ -117,26 +311,51 @@ void die(int error) {
 // Functions starting with `child_` are meant to be used in a child process,
 // the others in the parent process.
 
-void try_create_socket(ServiceData *config, bool isTcp){
-	config->socketFD = socket(AF_INET, isTcp ? SOCK_STREAM : SOCK_DGRAM, isTcp ? IPPROTO_TCP : IPPROTO_UDP);
-	if(config->socketFD < 0)
-		die(EXIT_SOCKET_CREATION_ERROR);
-}
 
-void try_bind(ServiceData *config, struct sockaddr_in serverAddr){
-	if (bind(config->socketFD, (struct sockaddr*)&serverAddr, sizeof(serverAddr)) < 0)
-		die(EXIT_SOCKET_BIND_ERROR);
-}
+// Error of the last failed accept that was reported, 0 after a successful one
+int reportedAcceptError = 0;
 
-void try_listen(ServiceData *config){
-	if(listen(config->socketFD, MAX_TCP_PENDING_CONNECTIONS) < 0)
-		die(EXIT_LISTEN_ERROR);
+void add_milliseconds(struct timespec *time, long milliseconds) {
+	time->tv_sec += milliseconds / 1000;
+	time->tv_nsec += (milliseconds % 1000) * 1000000;
+	if (time->tv_nsec >= 1000000000) {
+		time->tv_sec++;
+		time->tv_nsec -= 1000000000;
+	}
 }
 
-int try_accept(ServiceData *config){
-	int acceptResult = accept(config->socketFD, NULL, NULL);
-	if(acceptResult < 0)
+// Handles an accept error (an errno value). Running out of descriptors or memory
+// ends the batch like having no connections: they stay queued, and the service
+// is paused (returns true). It is reported once until an accept succeeds.
+bool report_accept_error(int error) {
+	if (error == EAGAIN || error == EWOULDBLOCK || error == ECONNABORTED || error == EINTR)
+		return false;
+	if (error != EMFILE && error != ENFILE && error != ENOBUFS && error != ENOMEM && error != EPROTO) {
+		errno = error;
 		die(EXIT_ACCEPT_ERROR);
+	}
+	if (reportedAcceptError != error) {
+		reportedAcceptError = error;
+		fprintf(stderr, "Cannot accept connection: %s\n", strerror(error));
+	}
+	return error != EPROTO;
+}
+
+// Accepts a pending connection from a non-blocking listening socket (`flags` as in
+// accept4); returns -1 if there are no more pending connections. A service out of
+// descriptors or memory is paused for ACCEPT_BACKOFF_MS: while its connections
+// stay queued, its socket would wake the dispatcher up again at once.
+int try_accept(ServiceData *config, int flags){
+	int acceptResult = accept4(config->socketFD, NULL, NULL, flags);
+	if(acceptResult < 0) {
+		if (report_accept_error(errno)) {
+			config->acceptPaused = true;
+			clock_gettime(CLOCK_MONOTONIC, &config->acceptPausedUntil);
+			add_milliseconds(&config->acceptPausedUntil, ACCEPT_BACKOFF_MS);
+		}
+		return -1;
+	}
+	reportedAcceptError = 0;
 	return acceptResult;
 }
 
@@ -146,6 +365,11 @@ void try_close(int socketFD) {
 	}
 }
 
+void try_create_channel(int channel[2]) {
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, channel) < 0)
+		die(EXIT_SOCKETPAIR_ERROR);
+}
+
 pid_t try_fork() {
 	pid_t result = fork();
 	if (result < 0)
@@ -153,16 +377,49 @@ pid_t try_fork() {
 	return result;
 }
 
-pid_t try_wait(int* status) {
-	pid_t pid = wait(status);
-	if (pid < 0)
-		die(EXIT_WAIT_ERROR);
+// Reaps a terminated child without blocking; returns 0 if there is none
+pid_t try_reap(int* status) {
+	pid_t pid = waitpid(-1, status, WNOHANG);
+	if (pid < 0) {
+		if (errno == ECHILD) {
+			return 0;
+		} else {
+			die(EXIT_WAIT_ERROR);
+		}
+	}
 	return pid;
 }
 
+// Blocks the given signals and returns a descriptor to read them from
+int try_signalfd(sigset_t *signals, sigset_t *previousMask) {
+	if (sigprocmask(SIG_BLOCK, signals, previousMask) < 0)
+		die(EXIT_SIGNAL_ERROR);
+	int result = signalfd(-1, signals, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (result < 0)
+		die(EXIT_SIGNAL_ERROR);
+	return result;
+}
+
+int try_timerfd_create() {
+	int result = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (result < 0)
+		die(EXIT_TIMER_ERROR);
+	return result;
+}
+
+// Arms the timer to expire once at the given CLOCK_MONOTONIC time
+void try_timerfd_start(int timerFD, struct timespec *deadline) {
+	struct itimerspec value;
+	memset(&value, 0, sizeof(value));
+	value.it_value = *deadline;
+	if (timerfd_settime(timerFD, TFD_TIMER_ABSTIME, &value, NULL) < 0)
+		die(EXIT_TIMER_ERROR);
+}
+
+#ifdef USE_SELECT
 // Returns true if there is some FD ready
-bool try_select(int highestFd, fd_set* readSet){
-	int result = select(highestFd, readSet, NULL, NULL, NULL);
+bool try_select(int highestFd, fd_set* readSet, fd_set* writeSet, struct timeval *timeout){
+	int result = select(highestFd, readSet, writeSet, NULL, timeout);
 	if (result < 0) {
 		if (errno == EINTR) {
 			return false;
@@ -172,18 +429,452 @@ bool try_select(int highestFd, fd_set* readSet){
 	}
 	return true;
 }
+#elif defined(USE_IO_URING)
+int try_io_uring_setup(unsigned entries, struct io_uring_params *params) {
+	int result = syscall(__NR_io_uring_setup, entries, params);
+	if (result < 0)
+		die(EXIT_IO_URING_ERROR);
+	return result;
+}
 
-void child_try_close(int socketFD) {
-	if (close(socketFD) < 0) {
-		exit(CHILD_EXIT_CLOSE_ERROR);
+void *try_io_uring_mmap(int ringFD, size_t size, off_t offset) {
+	void *result = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFD, offset);
+	if (result == MAP_FAILED)
+		die(EXIT_IO_URING_ERROR);
+	return result;
+}
+
+// Returns the number of submitted requests, 0 if interrupted by a signal or timed out
+int try_io_uring_enter(int ringFD, unsigned toSubmit, unsigned minComplete, unsigned flags,
+	void *argument, size_t argumentSize) {
+	int result = syscall(__NR_io_uring_enter, ringFD, toSubmit, minComplete, flags, argument, argumentSize);
+	if (result < 0) {
+		if (errno == EINTR || errno == ETIME || errno == EBUSY) {
+			return 0;
+		} else {
+			die(EXIT_IO_URING_ERROR);
+		}
+	}
+	return result;
+}
+#else
+int try_epoll_create() {
+	int result = epoll_create1(EPOLL_CLOEXEC);
+	if (result < 0)
+		die(EXIT_EPOLL_ERROR);
+	return result;
+}
+
+void try_epoll_ctl(int epollFD, int operation, int fd, struct epoll_event *event) {
+	if (epoll_ctl(epollFD, operation, fd, event) < 0)
+		die(EXIT_EPOLL_ERROR);
+}
+
+// Returns the number of ready events, 0 if interrupted by a signal
+int try_epoll_wait(int epollFD, struct epoll_event *events, int maxEvents, int timeout) {
+	int result = epoll_wait(epollFD, events, maxEvents, timeout);
+	if (result < 0) {
+		if (errno == EINTR) {
+			return 0;
+		} else {
+			die(EXIT_EPOLL_ERROR);
+		}
+	}
+	return result;
+}
+#endif
+
+// Signal mask to be restored in children before exec
+sigset_t childSignalMask;
+
+// The child_* functions run in a vfork child, which shares the memory of the
+// superserver: they only make system calls and leave with _exit.
+
+void child_restore_signals() {
+	if (sigprocmask(SIG_SETMASK, &childSignalMask, NULL) < 0)
+		_exit(CHILD_EXIT_EXECLE_ERROR);
+}
+
+// Makes `targetFD` a copy of `socketFD` which is kept across exec
+void child_try_dup2(int socketFD, int targetFD) {
+	int result = socketFD == targetFD ? fcntl(socketFD, F_SETFD, 0) : dup2(socketFD, targetFD);
+	if (result < 0)
+		_exit(CHILD_EXIT_DUP_ERROR);
+}
+
+// ============================ Event dispatcher ===========================
+// The dispatcher watches file descriptors for incoming data and returns the
+// sources (the opaque pointers registered along with each descriptor) that
+// became ready. It is backed by epoll, so a wakeup only touches the ready
+// sources; building with -DUSE_SELECT falls back to select, and building with
+// -DUSE_IO_URING uses io_uring.
+
+#ifdef USE_SELECT
+
+fd_set watchedSet;
+fd_set watchedOutputSet;
+int highestWatchedFd = -1;
+void *watchedSources[FD_SETSIZE];
+
+void dispatcher_initialize() {
+	FD_ZERO(&watchedSet);
+	FD_ZERO(&watchedOutputSet);
+}
+
+void dispatcher_watch(int fd, void *source) {
+	if (fd >= FD_SETSIZE)
+		die(EXIT_TOO_MANY_SOCKETS_ERROR);
+	watchedSources[fd] = source;
+	FD_SET(fd, &watchedSet);
+	if (fd > highestWatchedFd)
+		highestWatchedFd = fd;
+}
+
+// Also reports a watched descriptor when it becomes writable (if `enabled`)
+void dispatcher_watch_output(int fd, void *source, bool enabled) {
+	if (enabled) {
+		FD_SET(fd, &watchedOutputSet);
+	} else {
+		FD_CLR(fd, &watchedOutputSet);
+	}
+}
+
+void dispatcher_ignore(int fd) {
+	FD_CLR(fd, &watchedSet);
+	FD_CLR(fd, &watchedOutputSet);
+}
+
+// Watches a listening socket; only io_uring accepts the connections itself
+void dispatcher_watch_accept(int fd, void *source, int flags) {
+	dispatcher_watch(fd, source);
+}
+
+// Waits for ready descriptors, at most `timeout` milliseconds (-1 for no limit),
+// and stores their sources in `ready` (and -1 in `accepted`, see the io_uring dispatcher).
+// Returns the number of ready sources (0 if interrupted by a signal or timed out).
+int dispatcher_wait(void **ready, int *accepted, int maxReady, int timeout) {
+	fd_set readSet = watchedSet; // Copy the watched sets (select will modify them)
+	fd_set writeSet = watchedOutputSet;
+	struct timeval limit = { timeout / 1000, (timeout % 1000) * 1000 };
+	if (!try_select(highestWatchedFd + 1, &readSet, &writeSet, timeout < 0 ? NULL : &limit))
+		return 0;
+	int count = 0;
+	for (int fd = 0; fd <= highestWatchedFd && count < maxReady; fd++) {
+		if (FD_ISSET(fd, &readSet) || FD_ISSET(fd, &writeSet)) {
+			accepted[count] = -1;
+			ready[count++] = watchedSources[fd];
+		}
+	}
+	return count;
+}
+
+#elif defined(USE_IO_URING)
+// Every watched descriptor has a one-shot poll request in the ring. The
+// sources returned by a wait are polled again by the next one, so the
+// descriptors are level-triggered as with the other backends, and the new
+// requests are submitted by the same system call that waits.
+// Listening sockets watched with dispatcher_watch_accept have a multishot
+// accept request instead: the kernel accepts the connections by itself and
+// each one is returned along with its source.
+
+typedef struct {
+	void *source;
+	bool watched;
+	bool output; // Also reported when writable
+	bool armed; // A request is in the ring
+	bool accepting; // The request is a multishot accept, with `acceptFlags` as in accept4
+	int acceptFlags;
+	bool cancelPending; // Ignored: the accept is cancelled by the next wait, unless watched again
+	unsigned generation; // Tells the completions of older requests apart
+} UringSource;
+
+// user_data of the requests whose completion is not interesting
+#define URING_IGNORED_DATA UINT64_MAX
+// Set in the user_data of accept requests (descriptors never reach it)
+#define URING_ACCEPT_DATA (1U << 31)
+
+int ringFD = -1;
+unsigned *sqHead, *sqTail, *sqMask, *sqArray, sqEntries;
+struct io_uring_sqe *sqes;
+unsigned *cqHead, *cqTail, *cqMask;
+struct io_uring_cqe *cqes;
+
+UringSource *uringSources = NULL; // Indexed by descriptor
+int uringSourcesSize = 0;
+int rearmFDs[MAX_READY_SOURCES]; // Descriptors returned by the last wait
+int rearmCount = 0;
+int *cancelFDs = NULL; // Accepting descriptors ignored since the last wait
+int cancelCount = 0;
+int cancelCapacity = 0;
+bool multishotAccept = true; // Cleared if the kernel does not support it
+
+void dispatcher_initialize() {
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	ringFD = try_io_uring_setup(URING_ENTRIES, &params);
+
+	size_t sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	size_t cqSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+		sqSize = cqSize = sqSize > cqSize ? sqSize : cqSize;
+	char *sqRing = try_io_uring_mmap(ringFD, sqSize, IORING_OFF_SQ_RING);
+	char *cqRing = params.features & IORING_FEAT_SINGLE_MMAP ? sqRing :
+		try_io_uring_mmap(ringFD, cqSize, IORING_OFF_CQ_RING);
+	sqes = try_io_uring_mmap(ringFD, params.sq_entries * sizeof(struct io_uring_sqe), IORING_OFF_SQES);
+
+	sqHead = (unsigned*)(sqRing + params.sq_off.head);
+	sqTail = (unsigned*)(sqRing + params.sq_off.tail);
+	sqMask = (unsigned*)(sqRing + params.sq_off.ring_mask);
+	sqArray = (unsigned*)(sqRing + params.sq_off.array);
+	sqEntries = params.sq_entries;
+	cqHead = (unsigned*)(cqRing + params.cq_off.head);
+	cqTail = (unsigned*)(cqRing + params.cq_off.tail);
+	cqMask = (unsigned*)(cqRing + params.cq_off.ring_mask);
+	cqes = (struct io_uring_cqe*)(cqRing + params.cq_off.cqes);
+}
+
+// Number of queued requests not submitted yet
+unsigned uring_pending() {
+	return *sqTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+}
+
+// Queues a request; it is submitted by the next wait (or now, if the queue is full).
+// `flags` are the poll events or the accept flags.
+void uring_queue(__u8 opcode, int fd, __u32 flags, __u16 ioprio, __u64 address, __u64 userData) {
+	if (uring_pending() == sqEntries)
+		try_io_uring_enter(ringFD, sqEntries, 0, 0, NULL, 0);
+	unsigned tail = *sqTail;
+	struct io_uring_sqe *sqe = &sqes[tail & *sqMask];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = opcode;
+	sqe->fd = fd;
+	sqe->poll32_events = flags;
+	sqe->ioprio = ioprio;
+	sqe->addr = address;
+	sqe->user_data = userData;
+	sqArray[tail & *sqMask] = tail & *sqMask;
+	__atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+}
+
+__u64 uring_user_data(int fd) {
+	UringSource *entry = &uringSources[fd];
+	return ((__u64)entry->generation << 32) | (unsigned)fd | (entry->accepting ? URING_ACCEPT_DATA : 0);
+}
+
+void uring_arm(int fd) {
+	UringSource *entry = &uringSources[fd];
+	entry->generation++;
+	entry->armed = true;
+	if (entry->accepting)
+		uring_queue(IORING_OP_ACCEPT, fd, entry->acceptFlags, IORING_ACCEPT_MULTISHOT, 0, uring_user_data(fd));
+	else
+		uring_queue(IORING_OP_POLL_ADD, fd, entry->output ? POLLIN | POLLOUT : POLLIN, 0, 0, uring_user_data(fd));
+}
+
+// Cancels the request of a descriptor; its completions will be discarded
+void uring_disarm(int fd) {
+	UringSource *entry = &uringSources[fd];
+	if (entry->armed)
+		uring_queue(entry->accepting ? IORING_OP_ASYNC_CANCEL : IORING_OP_POLL_REMOVE, -1, 0, 0,
+			uring_user_data(fd), URING_IGNORED_DATA);
+	entry->armed = false;
+	entry->cancelPending = false;
+	entry->generation++;
+}
+
+// Prepares the entry of a descriptor to be watched again
+UringSource *uring_watch(int fd, void *source) {
+	if (fd >= uringSourcesSize) {
+		int size = fd + 1 > 2 * uringSourcesSize ? fd + 1 : 2 * uringSourcesSize;
+		uringSources = (UringSource*)realloc(uringSources, size * sizeof(UringSource));
+		memset(uringSources + uringSourcesSize, 0, (size - uringSourcesSize) * sizeof(UringSource));
+		uringSourcesSize = size;
+	}
+	UringSource *entry = &uringSources[fd];
+	entry->source = source;
+	entry->watched = true;
+	entry->output = false;
+	return entry;
+}
+
+void dispatcher_watch(int fd, void *source) {
+	UringSource *entry = uring_watch(fd, source);
+	if (entry->cancelPending)
+		uring_disarm(fd);
+	entry->accepting = false;
+	uring_arm(fd);
+}
+
+// Watches a listening socket: the connections are accepted by the dispatcher
+// (with `flags` as in accept4) and returned by the waits along with `source`
+void dispatcher_watch_accept(int fd, void *source, int flags) {
+	if (!multishotAccept) {
+		dispatcher_watch(fd, source);
+		return;
+	}
+	UringSource *entry = uring_watch(fd, source);
+	if (entry->cancelPending && entry->acceptFlags == flags) { // Still accepting
+		entry->cancelPending = false;
+		return;
 	}
+	if (entry->cancelPending)
+		uring_disarm(fd);
+	entry->accepting = true;
+	entry->acceptFlags = flags;
+	uring_arm(fd);
 }
 
-void child_try_dup(int socketFD) {
-	if (dup(socketFD) < 0)
-		exit(CHILD_EXIT_DUP_ERROR);
+// Also reports a watched descriptor when it becomes writable (if `enabled`)
+void dispatcher_watch_output(int fd, void *source, bool enabled) {
+	UringSource *entry = &uringSources[fd];
+	if (entry->output == enabled)
+		return;
+	entry->output = enabled;
+	if (entry->armed) { // Poll again with the new events
+		uring_disarm(fd);
+		uring_arm(fd);
+	}
+}
+
+// The accept of a listening socket is only cancelled by the next wait: a
+// configuration reload ignores the sockets it keeps and watches them again
+void dispatcher_ignore(int fd) {
+	UringSource *entry = &uringSources[fd];
+	entry->watched = false;
+	if (!entry->accepting || !entry->armed) {
+		uring_disarm(fd);
+		return;
+	}
+	entry->cancelPending = true;
+	if (cancelCount == cancelCapacity) {
+		cancelCapacity = cancelCapacity == 0 ? 16 : 2 * cancelCapacity;
+		cancelFDs = (int*)realloc(cancelFDs, cancelCapacity * sizeof(int));
+	}
+	cancelFDs[cancelCount++] = fd;
+}
+
+// Waits for ready descriptors, at most `timeout` milliseconds (-1 for no limit),
+// and stores their sources in `ready`. For a source watched with
+// dispatcher_watch_accept, `accepted` gets the accepted connection, otherwise -1.
+// Returns the number of ready sources (0 if interrupted by a signal or timed out).
+int dispatcher_wait(void **ready, int *accepted, int maxReady, int timeout) {
+	for (int i = 0; i < cancelCount; i++) {
+		if (uringSources[cancelFDs[i]].cancelPending)
+			uring_disarm(cancelFDs[i]);
+	}
+	cancelCount = 0;
+	for (int i = 0; i < rearmCount; i++) {
+		UringSource *entry = &uringSources[rearmFDs[i]];
+		if (entry->watched && !entry->armed)
+			uring_arm(rearmFDs[i]);
+	}
+	rearmCount = 0;
+
+	// Submit the queued requests and wait for a completion, unless there are some already
+	unsigned head = *cqHead;
+	bool completed = head != __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+	struct __kernel_timespec limit = { timeout / 1000, (timeout % 1000) * 1000000 };
+	struct io_uring_getevents_arg argument;
+	memset(&argument, 0, sizeof(argument));
+	argument.ts = (__u64)(uintptr_t)&limit;
+	unsigned flags = completed ? 0 : IORING_ENTER_GETEVENTS;
+	if (!completed && timeout >= 0)
+		flags |= IORING_ENTER_EXT_ARG;
+	try_io_uring_enter(ringFD, uring_pending(), completed ? 0 : 1, flags,
+		flags & IORING_ENTER_EXT_ARG ? &argument : NULL, flags & IORING_ENTER_EXT_ARG ? sizeof(argument) : 0);
+
+	if (maxReady > MAX_READY_SOURCES)
+		maxReady = MAX_READY_SOURCES;
+	int count = 0;
+	unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+	for (; head != tail && count < maxReady && rearmCount < MAX_READY_SOURCES; head++) {
+		struct io_uring_cqe *cqe = &cqes[head & *cqMask];
+		if (cqe->user_data == URING_IGNORED_DATA)
+			continue;
+		int fd = (int)(cqe->user_data & ~URING_ACCEPT_DATA & 0xFFFFFFFF);
+		UringSource *entry = &uringSources[fd];
+		bool current = entry->watched && uring_user_data(fd) == cqe->user_data;
+		if (!(cqe->user_data & URING_ACCEPT_DATA)) {
+			if (!current)
+				continue; // Completion of a cancelled request
+			entry->armed = false;
+			accepted[count] = -1;
+			ready[count++] = entry->source;
+			rearmFDs[rearmCount++] = fd;
+			continue;
+		}
+
+		if (current && !(cqe->flags & IORING_CQE_F_MORE)) { // The accept has ended: submit it again
+			entry->armed = false;
+			rearmFDs[rearmCount++] = fd;
+		}
+		if (!current) { // Cancelled, maybe after accepting a connection
+			if (cqe->res >= 0)
+				close(cqe->res);
+		} else if (cqe->res == -EINVAL) { // No multishot accept: poll from now on
+			multishotAccept = false;
+			entry->accepting = false;
+		} else if (cqe->res < 0) { // Accepting again by hand handles the error
+			accepted[count] = -1;
+			ready[count++] = entry->source;
+		} else {
+			accepted[count] = cqe->res;
+			ready[count++] = entry->source;
+		}
+	}
+	__atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+	return count;
+}
+
+#else
+
+int epollFD = -1;
+
+void dispatcher_initialize() {
+	epollFD = try_epoll_create();
+}
+
+void dispatcher_watch(int fd, void *source) {
+	struct epoll_event event;
+	event.events = EPOLLIN;
+	event.data.ptr = source;
+	try_epoll_ctl(epollFD, EPOLL_CTL_ADD, fd, &event);
+}
+
+// Also reports a watched descriptor when it becomes writable (if `enabled`)
+void dispatcher_watch_output(int fd, void *source, bool enabled) {
+	struct epoll_event event;
+	event.events = enabled ? EPOLLIN | EPOLLOUT : EPOLLIN;
+	event.data.ptr = source;
+	try_epoll_ctl(epollFD, EPOLL_CTL_MOD, fd, &event);
+}
+
+void dispatcher_ignore(int fd) {
+	try_epoll_ctl(epollFD, EPOLL_CTL_DEL, fd, NULL);
+}
+
+// Watches a listening socket; only io_uring accepts the connections itself
+void dispatcher_watch_accept(int fd, void *source, int flags) {
+	dispatcher_watch(fd, source);
+}
+
+// Waits for ready descriptors, at most `timeout` milliseconds (-1 for no limit),
+// and stores their sources in `ready` (and -1 in `accepted`, see the io_uring dispatcher).
+// Returns the number of ready sources (0 if interrupted by a signal or timed out).
+int dispatcher_wait(void **ready, int *accepted, int maxReady, int timeout) {
+	struct epoll_event events[MAX_READY_SOURCES];
+	if (maxReady > MAX_READY_SOURCES)
+		maxReady = MAX_READY_SOURCES;
+	int count = try_epoll_wait(epollFD, events, maxReady, timeout);
+	for (int i = 0; i < count; i++) {
+		ready[i] = events[i].data.ptr;
+		accepted[i] = -1;
+	}
+	return count;
 }
 
+#endif
+
 // ============================ Helper functions ===========================
 
 // Checks if the given null-terminated string contains only whitespaces
@@ -207,6 +898,57 @@ bool is_valid_port(char* s) {
 	return atoi(s) > 0 && atoi(s) <= PORT_MAX;
 }
 
+// Gets the internal service selected by a service path, INTERNAL_NONE if the path
+// is not 'internal:<name>'. Returns false if the internal service does not exist.
+bool get_internal_type(char *path, InternalType *internal) {
+	size_t prefixLength = strlen(INTERNAL_PREFIX);
+	*internal = INTERNAL_NONE;
+	if (strncmp(path, INTERNAL_PREFIX, prefixLength) != 0)
+		return true;
+	for (int type = INTERNAL_NONE + 1; type < INTERNAL_TYPES_COUNT; type++) {
+		if (strcmp(path + prefixLength, internalServiceNames[type]) == 0) {
+			*internal = type;
+			return true;
+		}
+	}
+	return false;
+}
+
+// Reads the optional 'name=value' fields following the service mode.
+// Returns false if an option is not valid.
+bool read_service_options(ServiceData *config, char *options) {
+	char *savePointer;
+	for (char *option = strtok_r(options, " \t\r\n", &savePointer); option != NULL;
+		option = strtok_r(NULL, " \t\r\n", &savePointer)) {
+		char *value = strchr(option, '=');
+		if (value == NULL || value[1] == '\0')
+			return false;
+		*value++ = '\0';
+		for (char *c = value; *c != '\0'; c++) {
+			if (!isdigit(*c))
+				return false;
+		}
+		if (strlen(value) > 9)
+			return false;
+		int number = atoi(value);
+
+		// Limits only apply to services forking a child per request
+		bool isForking = config->internal == INTERNAL_NONE && strcmp(config->mode, MODE_PREFORK) != 0 &&
+			strcmp(config->mode, MODE_ACTIVATE) != 0;
+		if (strcmp(option, OPTION_BACKLOG) == 0 && strcmp(config->protocol, PROTOCOL_TCP) == 0 &&
+			number > 0 && number <= MAX_TCP_BACKLOG) {
+			config->backlog = number;
+		} else if (strcmp(option, OPTION_MAX_CHILDREN) == 0 && isForking && number > 0) {
+			config->maxChildren = number;
+		} else if (strcmp(option, OPTION_MAX_RATE) == 0 && isForking && number > 0) {
+			config->maxRate = number;
+		} else {
+			return false;
+		}
+	}
+	return true;
+}
+
 // Counts non-empty lines in a stream (a line is empty if there are no chars or only whites)
 size_t count_lines(FILE *stream) {
 	size_t lines = 0;
@@ -226,21 +968,47 @@ size_t count_lines(FILE *stream) {
 void print_config(ServiceDataVector config) {
 	for (int i = 0; i < config.size; i++) {
 		ServiceData *current = &config.services[i];
-		printf("  %s (%s) :%s, %s %s\n", current->path, current->name, current->port, current->mode, current->protocol);
+		printf("  %s (%s) :%s, %s %s", current->path, current->name, current->port, current->mode, current->protocol);
+		if (strcmp(current->mode, MODE_PREFORK) == 0)
+			printf(" (%d workers)", current->workerCount);
+		if (strcmp(current->protocol, PROTOCOL_TCP) == 0)
+			printf(", backlog %d", current->backlog);
+		if (current->maxChildren > 0)
+			printf(", max %d children", current->maxChildren);
+		if (current->maxRate > 0)
+			printf(", max %d requests/s", current->maxRate);
+		printf("\n");
 	}
 }
 
-ServiceDataVector read_configuration(FILE *stream) {
+// Frees a ServiceDataVector memory
+void free_services(ServiceDataVector *config) {
+	for (size_t i = 0; i < config->size; i++) {
+		free(config->services[i].workers);
+		free(config->services[i].children.pids);
+		free(config->services[i].childStats);
+		if (config->services[i].binaryFD >= 0)
+			close(config->services[i].binaryFD);
+	}
+	free(config->services);
+	config->size = 0;
+}
+
+// Parses the configuration in `config`. Returns 0 on success, otherwise
+// the error code (and the configuration is left empty).
+int read_configuration(FILE *stream, ServiceDataVector *output) {
 	// Initialize the conf vector counting the lines in conf file
 	ServiceDataVector config;
 	long fileBegin = ftell(stream);
 	config.size = count_lines(stream);
 	fseek(stream, fileBegin, SEEK_SET);
 	config.services = (ServiceData*)malloc(config.size * sizeof(ServiceData));
+	output->size = 0;
+	output->services = NULL;
 
 	// Generate the format string to read parameters from a line
-	char formatString[7*4];
-	sprintf(formatString, "%%%ds %%%ds %%%ds %%%ds",
+	char formatString[8*4];
+	sprintf(formatString, "%%%ds %%%ds %%%ds %%%ds%%n",
 		MAX_NAME_SIZE-1, PROTOCOL_TYPE_SIZE-1, PORT_NUMBER_SIZE-1, SERVICE_MODE_SIZE-1);
 
 	// Read and parse line by line
@@ -249,37 +1017,88 @@ ServiceDataVector read_configuration(FILE *stream) {
 		do { // Find the next non-empty line
 			char* result = fgets(line, MAX_LINE_SIZE, stream);
 			if (result == NULL) { // Must be an error because we previously counted non-empty lines
-				die(EXIT_READ_ERROR);
+				config.size = index;
+				free_services(&config);
+				return EXIT_READ_ERROR;
 			}
 		} while(is_empty(line));
 
 		ServiceData *current = &config.services[index];
-		current->pid = 0;
+		current->sourceType = SOURCE_SERVICE;
+		current->binaryFD = -1;
+		current->maxChildren = 0;
+		current->maxRate = 0;
+		current->deferred = false;
+		current->acceptPaused = false;
+		current->resumeQueued = false;
+		current->rateCount = 0;
+		current->workerCount = 0;
+		current->nextWorker = 0;
+		current->idleWorkers = 0;
+		current->workers = NULL;
+		current->fastFailures = 0;
+		current->gaveUp = false;
+		current->backlog = DEFAULT_TCP_BACKLOG;
+		memset(&current->acceptStats, 0, sizeof(AcceptStats));
+		memset(&current->children, 0, sizeof(ChildTable));
+		current->childStats = (ChildStats*)calloc(1, sizeof(ChildStats));
 
 		// Extract data from the line and check validity
+		// (the number of workers is only present in 'prefork' mode)
+		int offset = 0, workersOffset = 0;
 		int count = sscanf(line, formatString,
-			current->path, current->protocol, current->port, current->mode);
+			current->path, current->protocol, current->port, current->mode, &offset);
+		bool isPrefork = count == 4 && strcmp(MODE_PREFORK, current->mode) == 0;
+		bool isActivate = count == 4 && strcmp(MODE_ACTIVATE, current->mode) == 0;
+		if (isPrefork && sscanf(line + offset, " %d%n", &current->workerCount, &workersOffset) != 1)
+			count = 0;
+		if (isActivate)
+			current->workerCount = 1; // The service itself, restarted when it exits
 		if (count != 4 ||
 			(strcmp(PROTOCOL_UDP, current->protocol) != 0 && strcmp(PROTOCOL_TCP, current->protocol) != 0) ||
-			(strcmp(MODE_WAIT, current->mode) != 0 && strcmp(MODE_NOWAIT, current->mode) != 0) ||
-			!is_valid_port(current->port)) {
-			die(EXIT_CONF_ERROR);
+			(strcmp(MODE_WAIT, current->mode) != 0 && strcmp(MODE_NOWAIT, current->mode) != 0 &&
+				!isPrefork && !isActivate) ||
+			(isPrefork && (strcmp(PROTOCOL_TCP, current->protocol) != 0 ||
+				current->workerCount <= 0 || current->workerCount > MAX_PREFORK_WORKERS)) ||
+			!is_valid_port(current->port) ||
+			!get_internal_type(current->path, &current->internal) ||
+			(current->internal != INTERNAL_NONE && (isPrefork || isActivate)) ||
+			(current->internal == INTERNAL_STATS && strcmp(PROTOCOL_TCP, current->protocol) != 0) ||
+			!read_service_options(current, line + offset + workersOffset)) {
+			config.size = index + 1;
+			free_services(&config);
+			return EXIT_CONF_ERROR;
 		}
 		const char *lastSlash = strrchr(current->path, '/'); // Extract executable name from path
 		strcpy(current->name, lastSlash == NULL ? current->path : lastSlash+1);
+		// Resolve the binary once: a missing one is reported by the children as before
+		if (current->internal == INTERNAL_NONE)
+			current->binaryFD = open(current->path, O_PATH | O_CLOEXEC);
 	}
-	return config;
+	*output = config;
+	return 0;
 }
 
-// Reads configuration from the right file
-ServiceDataVector read_server_configuration(){
+// Reads configuration from the right file; returns 0 on success, otherwise the error code
+int load_server_configuration(ServiceDataVector *config) {
 	FILE *fp = fopen(SUPERSERVER_CONF_FILE_NAME, "r");
 	if(fp == NULL)
-		die(EXIT_SUPERSERVER_CONFIG_FILE_ERROR);
-	ServiceDataVector config = read_configuration(fp);
-	printf("Configuration file read successfully:\n");
-	print_config(config);
+		return EXIT_SUPERSERVER_CONFIG_FILE_ERROR;
+	int error = read_configuration(fp, config);
 	fclose(fp);
+	if (error == 0) {
+		printf("Configuration file read successfully:\n");
+		print_config(*config);
+	}
+	return error;
+}
+
+// Reads configuration from the right file, exiting on errors
+ServiceDataVector read_server_configuration(){
+	ServiceDataVector config;
+	int error = load_server_configuration(&config);
+	if (error != 0)
+		die(error);
 	return config;
 }
 
@@ -291,6 +1110,41 @@ bool is_service_wait(ServiceData* config) {
 	return strcmp(config->mode, MODE_WAIT) == 0;
 }
 
+bool is_service_prefork(ServiceData* config) {
+	return strcmp(config->mode, MODE_PREFORK) == 0;
+}
+
+bool is_service_activated(ServiceData* config) {
+	return strcmp(config->mode, MODE_ACTIVATE) == 0;
+}
+
+// Checks if the dispatcher watches the socket of a service: an 'activate'
+// service accepts by itself, a deferred one is over its limits
+bool is_service_watched(ServiceData* config) {
+	return !is_service_activated(config) && !config->deferred;
+}
+
+// Flags of the connections accepted for a service: internal services serve
+// them without blocking, children get them as they are
+int get_accept_flags(ServiceData *config) {
+	return config->internal != INTERNAL_NONE ? SOCK_NONBLOCK | SOCK_CLOEXEC : SOCK_CLOEXEC;
+}
+
+// Checks if a TCP service takes every connection as soon as it arrives: it has
+// no limits which could defer it, so the dispatcher may accept for it
+bool is_accepting_always(ServiceData *config) {
+	return is_service_tcp(config) && !is_service_wait(config) && !is_service_prefork(config) &&
+		config->maxChildren == 0 && config->maxRate == 0;
+}
+
+// Starts watching the socket of a service
+void watch_service(ServiceData *config) {
+	if (is_accepting_always(config))
+		dispatcher_watch_accept(config->socketFD, config, get_accept_flags(config));
+	else
+		dispatcher_watch(config->socketFD, config);
+}
+
 // Gets the server address for binding the socket of the given service
 struct sockaddr_in get_initialized_server_addr(ServiceData* config){
 	struct sockaddr_in serverAddr;
@@ -300,159 +1154,1454 @@ struct sockaddr_in get_initialized_server_addr(ServiceData* config){
 	return serverAddr;
 }
 
-// Initializes the socket for the given service
-void initialize_service(ServiceData *config) {
+bool set_option(int socketFD, int level, int option, int value) {
+	return setsockopt(socketFD, level, option, &value, sizeof(value)) == 0;
+}
+
+bool is_socket_nonblocking(ServiceData *config) {
+	return is_service_tcp(config) && !is_service_activated(config);
+}
+
+// Opens the socket for the given service. With `reusePort` every dispatcher
+// process binds its own socket and the kernel spreads the load.
+// Returns 0 on success, otherwise the error code (nothing is left open).
+int open_service(ServiceData *config, bool reusePort) {
 	bool isTcp = is_service_tcp(config);
 
 	struct sockaddr_in serverAddr = get_initialized_server_addr(config);
 
-	try_create_socket(config, isTcp);
-	try_bind(config, serverAddr);
-	if (isTcp) try_listen(config);
-}
+	// Close-on-exec: children only get the sockets they serve, so closing a
+	// service actually releases its port. TCP listening sockets are non-blocking
+	// so that every wakeup can drain the accept queue; UDP sockets stay blocking
+	// because 'wait' children get them as they are, and so do the sockets of
+	// 'activate' services. UDP sockets report the destination address of each
+	// datagram, so that 'nowait' children answer from it.
+	config->socketFD = socket(AF_INET, (isTcp ? SOCK_STREAM : SOCK_DGRAM) | SOCK_CLOEXEC |
+		(is_socket_nonblocking(config) ? SOCK_NONBLOCK : 0), isTcp ? IPPROTO_TCP : IPPROTO_UDP);
+	if (config->socketFD < 0)
+		return EXIT_SOCKET_CREATION_ERROR;
 
-// Initialize all services, returns the highest file descriptor + 1 (useful for select)
-int initialize_all_services(ServiceDataVector *config) {
-	int maxFd = -1;
-	for (size_t i = 0; i < config->size; i++) {
-		initialize_service(&config->services[i]);
-		if (config->services[i].socketFD > maxFd) {
-			maxFd = config->services[i].socketFD;
-		}
+	int error = 0;
+	// Internal services close first: allow rebinding while in TIME_WAIT
+	if ((isTcp && !set_option(config->socketFD, SOL_SOCKET, SO_REUSEADDR, 1)) ||
+		(reusePort && !set_option(config->socketFD, SOL_SOCKET, SO_REUSEPORT, 1)) ||
+		(!isTcp && !set_option(config->socketFD, IPPROTO_IP, IP_PKTINFO, 1)))
+		error = EXIT_SOCKET_OPTION_ERROR;
+	else if (bind(config->socketFD, (struct sockaddr*)&serverAddr, sizeof(serverAddr)) < 0)
+		error = EXIT_SOCKET_BIND_ERROR;
+	else if (isTcp && listen(config->socketFD, config->backlog) < 0)
+		error = EXIT_LISTEN_ERROR;
+
+	if (error != 0) {
+		print_error(error);
+		close(config->socketFD);
 	}
-	return maxFd + 1;
+	return error;
 }
 
-// Frees a ServiceDataVector memory
-void free_services(ServiceDataVector *config) {
-	free(config->services);
-	config->size = 0;
+// Initializes the socket for the given service, exiting on errors
+void initialize_service(ServiceData *config, bool reusePort) {
+	int error = open_service(config, reusePort);
+	if (error != 0)
+		exit(error);
 }
 
-// Creates a child process for the servicel; never returns
-void spawn_service(int inputSocketFD, ServiceData *config, char * const envp[]) {
-	child_try_close(0);
-	child_try_dup(inputSocketFD);
-
-	child_try_close(1);
-	child_try_dup(inputSocketFD);
-
-	child_try_close(2);
-	child_try_dup(inputSocketFD);
-
-	if (execle(config->path, config->name, (char*)NULL, envp) < 0) {
-		if (strcmp(config->protocol, PROTOCOL_UDP) == 0) {
-			recv(inputSocketFD, NULL, 0, 0); // This should remove any pending data
-		}
-		exit(CHILD_EXIT_EXECLE_ERROR);
+// Initialize all services and starts watching their sockets
+void initialize_all_services(ServiceDataVector *config, bool reusePort) {
+	for (size_t i = 0; i < config->size; i++) {
+		initialize_service(&config->services[i], reusePort);
+		if (is_service_watched(&config->services[i]))
+			watch_service(&config->services[i]);
 	}
 }
 
-// Handles a connection request for a service
-void handle_service(ServiceData* config, char **env, fd_set* socketsSet){
-	bool isTcp = is_service_tcp(config);
-	int receiveSocketFD; // Socket to be used in the child
-	if (isTcp) {
-		receiveSocketFD = try_accept(config);
-	} else {
-		receiveSocketFD = config->socketFD;
+// Runs the binary of a service in a new process, with `inputSocketFD` on
+// descriptor 0 and `outputSocketFD` on the ones from 1 to `lastFD`; returns
+// the child PID.
+// vfork does not copy the page tables of the superserver, so spawning does not
+// get slower as the superserver grows; the binary was opened when the
+// configuration was read, so exec does not look up its path either. Building
+// with -DUSE_FORK_EXEC forks and execs the path instead, to compare with.
+pid_t spawn_service(int inputSocketFD, int outputSocketFD, int lastFD, ServiceData *config,
+	char * const envp[]) {
+	char * const argv[] = { config->name, NULL };
+#ifdef USE_FORK_EXEC
+	pid_t pid = try_fork();
+#else
+	pid_t pid = vfork(); // Not wrapped: the child must not return from the caller of vfork
+	if (pid < 0)
+		die(EXIT_FORK_ERROR);
+#endif
+	if (pid != 0)
+		return pid;
+
+	// In the child: every other descriptor is closed on exec
+	for (int fd = 0; fd <= lastFD; fd++) {
+		child_try_dup2(fd == 0 ? inputSocketFD : outputSocketFD, fd);
 	}
-	printf("Handling service %s on %s port %s ('%s' mode).",
-		config->path, config->protocol, config->port, config->mode);
+	child_restore_signals();
+#ifndef USE_FORK_EXEC
+	if (config->binaryFD >= 0)
+		fexecve(config->binaryFD, argv, envp);
+	if (config->binaryFD < 0 || errno == ENOENT) // Scripts cannot be run from a close-on-exec FD
+#endif
+		execve(config->path, argv, envp);
+	if (strcmp(config->protocol, PROTOCOL_UDP) == 0) {
+		recv(inputSocketFD, NULL, 0, 0); // This should remove any pending data
+	}
+	_exit(CHILD_EXIT_EXECLE_ERROR);
+}
 
+// Starts an 'activate' service with the service socket on fd 3, as described
+// by LISTEN_FDS and LISTEN_PID (see activation.h); returns the child PID.
+// This is rare, so the child is forked: it needs its PID in the environment.
+pid_t spawn_activated_service(ServiceData *config, char * const envp[]) {
 	pid_t pid = try_fork();
-	if (pid == 0) { // In the child
-		if (isTcp) {
-			try_close(config->socketFD);
-		}
-		spawn_service(receiveSocketFD, config, env); // Never returns
-	}
+	if (pid != 0)
+		return pid;
 
-	// From now on in the father
-	printf(" Child PID is %d", pid);
-	if (isTcp) {
-		try_close(receiveSocketFD); // Close data TCP socket
-	}
-	if (is_service_wait(config)) {
-		// Remove the socket from the select set
-		FD_CLR(config->socketFD, socketsSet);
-		// and save the child PID
-		config->pid = pid;
-		printf("; ignoring other socket activity.");
+	// In the child: it accepts by itself, so nothing tells it that the superserver died
+	prctl(PR_SET_PDEATHSIG, SIGTERM);
+	// Replace any LISTEN_* variable of the superserver environment
+	size_t count = 0;
+	while (envp[count] != NULL) {
+		count++;
 	}
-	printf("\n");
+	char listenFds[32], listenPid[32];
+	snprintf(listenFds, sizeof(listenFds), "LISTEN_FDS=1");
+	snprintf(listenPid, sizeof(listenPid), "LISTEN_PID=%d", getpid());
+	char **environment = (char**)malloc((count + 3) * sizeof(char*));
+	size_t used = 0;
+	for (size_t i = 0; i < count; i++) {
+		if (strncmp(envp[i], "LISTEN_", strlen("LISTEN_")) != 0)
+			environment[used++] = envp[i];
+	}
+	environment[used++] = listenFds;
+	environment[used++] = listenPid;
+	environment[used] = NULL;
+
+	char * const argv[] = { config->name, NULL };
+	child_try_dup2(config->socketFD, LISTEN_FDS_START);
+	child_restore_signals();
+	if (config->binaryFD >= 0)
+		fexecve(config->binaryFD, argv, environment);
+	if (config->binaryFD < 0 || errno == ENOENT)
+		execve(config->path, argv, environment);
+	_exit(CHILD_EXIT_EXECLE_ERROR);
 }
 
-void initialize_socket_set(ServiceDataVector config, fd_set *socketsSet){
-	FD_ZERO(socketsSet);
-	for (size_t i = 0; i < config.size; i++) {
-		FD_SET(config.services[i].socketFD, socketsSet);
+// Creates a persistent worker for a 'prefork' service. The worker receives
+// the other end of its channel on fd 0 (see prefork.h), and the dispatcher
+// watches this end for the worker telling it is idle.
+// The worker of an 'activate' service is the service itself.
+void spawn_worker(ServiceData *config, PreforkWorker *worker, char * const envp[]) {
+	clock_gettime(CLOCK_MONOTONIC, &worker->startTime);
+	worker->sourceType = SOURCE_WORKER;
+	worker->service = config;
+	worker->idle = false;
+	worker->respawnPending = false;
+	if (is_service_activated(config)) {
+		worker->pid = spawn_activated_service(config, envp);
+		worker->channelFD = -1;
+		printf("Started %s on %s port %s, PID is %d\n",
+			config->path, config->protocol, config->port, worker->pid);
+		return;
 	}
-}
 
-//Function prototype devoted to handle the death of the son process
-void handle_signal (int sig);
+	int channel[2];
+	try_create_channel(channel);
 
-// These needs to be global because they are used in the signal handler
-ServiceDataVector config;
-fd_set socketsSet;
+	pid_t pid = spawn_service(channel[1], channel[1], 0, config, envp);
+	try_close(channel[1]);
+	worker->pid = pid;
+	worker->channelFD = channel[0];
+	dispatcher_watch(worker->channelFD, worker);
+	printf("Started worker of %s on %s port %s, PID is %d\n",
+		config->path, config->protocol, config->port, pid);
+}
 
-void main_loop(int highestFd, char **env){
-	while(true) {
-		fd_set readSet = socketsSet; // Copy the socketSet (select will modify it)
-		bool somethingReady = try_select(highestFd, &readSet);
+// Closes the channel of a worker which is dead or being stopped
+void close_worker_channel(ServiceData *config, PreforkWorker *worker) {
+	if (worker->channelFD < 0)
+		return;
+	dispatcher_ignore(worker->channelFD);
+	try_close(worker->channelFD);
+	worker->channelFD = -1;
+	if (worker->idle)
+		config->idleWorkers--;
+	worker->idle = false;
+}
 
-		if (somethingReady) { // Otherwise it has been interrupted by a signal
-			for (size_t i = 0; i < config.size; i++) {
-				if (FD_ISSET(config.services[i].socketFD, &readSet)) {
-					handle_service(&config.services[i], env, &socketsSet);
-				}
-			}
+// Starts the workers of every 'prefork' service and every 'activate' service
+void initialize_all_workers(ServiceDataVector *config, char * const envp[]) {
+	for (size_t i = 0; i < config->size; i++) {
+		ServiceData *current = &config->services[i];
+		if (current->workerCount == 0 || current->workers != NULL) // No workers or already started
+			continue;
+		current->workers = (PreforkWorker*)calloc(current->workerCount, sizeof(PreforkWorker));
+		for (int w = 0; w < current->workerCount; w++) {
+			spawn_worker(current, &current->workers[w], envp);
 		}
 	}
 }
 
-int main(int argc, char **argv, char **env) {
-	// Configuration loading
-	config = read_server_configuration();
-
-	int highestFd = initialize_all_services(&config);
-	initialize_socket_set(config, &socketsSet);
+// Sends a file descriptor over a Unix-domain socket without blocking.
+// Returns false if the receiver cannot take it right now.
+bool send_fd(int channelFD, int fd) {
+	char dummy = 0;
+	struct iovec iov = { .iov_base = &dummy, .iov_len = 1 };
+	union { // Properly aligned buffer for the control message
+		char buffer[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buffer;
+	msg.msg_controllen = sizeof(control.buffer);
 
-	// Handle signals sent by son processes
-	signal(SIGCHLD, handle_signal);
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
 
-	main_loop(highestFd, env);
+	return sendmsg(channelFD, &msg, MSG_DONTWAIT | MSG_NOSIGNAL) >= 0;
+}
 
-	free_services(&config);
+// Hands an accepted connection to an idle worker of a 'prefork' service (round
+// robin), so that no connection waits behind a busy one. Returns the PID of the
+// worker which received it, 0 if no worker could take it.
+pid_t hand_to_worker(ServiceData *config, int connectionFD) {
+	for (int attempt = 0; attempt < config->workerCount; attempt++) {
+		PreforkWorker *worker = &config->workers[config->nextWorker];
+		config->nextWorker = (config->nextWorker + 1) % config->workerCount;
+		if (worker->idle && send_fd(worker->channelFD, connectionFD)) {
+			worker->idle = false;
+			config->idleWorkers--;
+			return worker->pid;
+		}
+	}
 	return 0;
 }
 
-// Signal handler function
-void handle_signal(int sig) {
-	int childStatus;
-	pid_t childPid;
-	switch (sig) {
-		case SIGCHLD:
-			childPid = try_wait(&childStatus);
-			printf("PID %d exited\n", childPid);
-			if (WEXITSTATUS(childStatus) != 0) {
-				fprintf(stderr, "A child with PID %d exited with code %d\n", childPid, WEXITSTATUS(childStatus));
-				print_error(WEXITSTATUS(childStatus));
+// =========================== Accept statistics ===========================
+// Every wakeup of a TCP service drains its accept queue. The length of the
+// queue is sampled with TCP_INFO before draining it, to help sizing the backlog.
+
+// Samples the accept queue of a TCP service before draining it
+void start_accept_batch(ServiceData *config) {
+	AcceptStats *stats = &config->acceptStats;
+	struct tcp_info info;
+	socklen_t length = sizeof(info);
+	stats->wakeups++;
+	// On a listening socket tcpi_unacked is the accept queue length, tcpi_sacked its limit
+	if (getsockopt(config->socketFD, IPPROTO_TCP, TCP_INFO, &info, &length) == 0) {
+		if (info.tcpi_unacked > stats->maxQueued)
+			stats->maxQueued = info.tcpi_unacked;
+		if (info.tcpi_unacked >= info.tcpi_sacked)
+			stats->queueFull++;
+	}
+}
+
+void end_accept_batch(ServiceData *config, unsigned long accepted) {
+	AcceptStats *stats = &config->acceptStats;
+	stats->connections += accepted;
+	if (accepted > stats->maxBatch)
+		stats->maxBatch = accepted;
+}
+
+// Reads the system-wide count of connections dropped because an accept
+// queue was full, -1 if it is not available
+long read_listen_overflows() {
+	FILE *fp = fopen(NETSTAT_FILE_NAME, "r");
+	if (fp == NULL)
+		return -1;
+	// The file has pairs of lines: field names, then values
+	char names[4096], values[4096];
+	long result = -1;
+	while (result < 0 && fgets(names, sizeof(names), fp) != NULL && fgets(values, sizeof(values), fp) != NULL) {
+		if (strncmp(names, "TcpExt:", 7) != 0)
+			continue;
+		char *nameSave, *valueSave;
+		char *name = strtok_r(names, " \n", &nameSave);
+		char *value = strtok_r(values, " \n", &valueSave);
+		while (name != NULL && value != NULL) {
+			if (strcmp(name, "ListenOverflows") == 0) {
+				result = atol(value);
+				break;
+			}
+			name = strtok_r(NULL, " \n", &nameSave);
+			value = strtok_r(NULL, " \n", &valueSave);
+		}
+	}
+	fclose(fp);
+	return result;
+}
+
+// ============================ Child processes ============================
+// Every child spawned for a request is recorded in the table of its service,
+// so that its exit can be accounted to the service.
+
+double elapsed_seconds(struct timespec *since) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - since->tv_sec) + (now.tv_nsec - since->tv_nsec) / 1e9;
+}
+
+void add_child(ChildTable *table, pid_t pid) {
+	if (table->count == table->capacity) {
+		table->capacity = table->capacity == 0 ? 4 : table->capacity * 2;
+		table->pids = (pid_t*)realloc(table->pids, table->capacity * sizeof(pid_t));
+	}
+	table->pids[table->count++] = pid;
+}
+
+// Returns false if the child is not in the table
+bool remove_child(ChildTable *table, pid_t pid) {
+	for (int i = 0; i < table->count; i++) {
+		if (table->pids[i] == pid) {
+			table->pids[i] = table->pids[--table->count];
+			return true;
+		}
+	}
+	return false;
+}
+
+void record_fork(ChildStats *stats, double seconds) {
+	int bucket = 0;
+	for (double limit = 1e-6; bucket < FORK_LATENCY_BUCKETS - 1 && seconds >= limit; limit *= 2) {
+		bucket++;
+	}
+	stats->forks++;
+	stats->forkLatency[bucket]++;
+}
+
+void record_child_exit(ChildStats *stats, int childStatus) {
+	if (WIFSIGNALED(childStatus)) {
+		stats->killed++;
+		return;
+	}
+	stats->exitCodes[WEXITSTATUS(childStatus)]++;
+	if (WEXITSTATUS(childStatus) == CHILD_EXIT_EXECLE_ERROR)
+		stats->execFailures++;
+}
+
+// ================================ Limits =================================
+// A service over its limits is deferred: its socket is not watched, so new
+// requests wait in the kernel queues (and clients feel the backpressure)
+// instead of being refused. A 'wait' service is deferred while its child runs,
+// and a 'prefork' one while none of its workers is idle.
+// A service deferred by its rate, or paused after running out of descriptors,
+// waits in a queue ordered by the end of its rate window or pause, and a timer
+// watched by the dispatcher expires at the first one.
+
+// Timer expiring when the first service of resumeQueue can be watched again
+int resumeTimerFD = -1;
+ServiceData *resumeQueue = NULL;
+
+bool is_time_before(struct timespec *first, struct timespec *second) {
+	return first->tv_sec < second->tv_sec ||
+		(first->tv_sec == second->tv_sec && first->tv_nsec < second->tv_nsec);
+}
+
+// Inserts a deferred service in resumeQueue, rearming the timer if it comes first
+void queue_resume(ServiceData *config, struct timespec *time) {
+	config->resumeTime = *time;
+	config->resumeQueued = true;
+	ServiceData **next = &resumeQueue;
+	while (*next != NULL && !is_time_before(time, &(*next)->resumeTime)) {
+		next = &(*next)->nextResume;
+	}
+	config->nextResume = *next;
+	*next = config;
+	if (resumeQueue == config)
+		try_timerfd_start(resumeTimerFD, time);
+}
+
+// Milliseconds until the rate window of a service ends (0 if already ended)
+int rate_window_remaining(ServiceData *config) {
+	double remaining = 1 - elapsed_seconds(&config->rateWindowStart);
+	return remaining <= 0 ? 0 : (int)(remaining * 1000) + 1;
+}
+
+bool is_rate_exceeded(ServiceData *config) {
+	return config->maxRate > 0 && config->rateCount >= config->maxRate &&
+		rate_window_remaining(config) > 0;
+}
+
+// Counts a request in the rate window of a service
+void count_request(ServiceData *config) {
+	if (config->maxRate == 0)
+		return;
+	if (rate_window_remaining(config) == 0) {
+		clock_gettime(CLOCK_MONOTONIC, &config->rateWindowStart);
+		config->rateCount = 0;
+	}
+	config->rateCount++;
+}
+
+bool can_serve_request(ServiceData *config) {
+	int children = config->children.count;
+	return !(is_service_wait(config) && children > 0) &&
+		!(is_service_prefork(config) && config->idleWorkers == 0 && !config->gaveUp) &&
+		!(config->maxChildren > 0 && children >= config->maxChildren) &&
+		!is_rate_exceeded(config) && !config->acceptPaused;
+}
+
+// Starts or stops watching the socket of a service according to its limits
+// (a service deferred by its rate or paused is queued to be checked again)
+void update_deferral(ServiceData *config) {
+	if (is_service_activated(config))
+		return; // Its socket is never watched
+	bool canServe = can_serve_request(config);
+	if (canServe && config->deferred) {
+		watch_service(config);
+		config->deferred = false;
+		config->childStats->deferredSeconds += elapsed_seconds(&config->childStats->deferredSince);
+	} else if (!canServe && !config->deferred) {
+		dispatcher_ignore(config->socketFD);
+		config->deferred = true;
+		config->childStats->deferrals++;
+		clock_gettime(CLOCK_MONOTONIC, &config->childStats->deferredSince);
+	}
+	if (config->deferred && !config->resumeQueued && config->acceptPaused) {
+		queue_resume(config, &config->acceptPausedUntil);
+	} else if (config->deferred && !config->resumeQueued && is_rate_exceeded(config)) {
+		struct timespec windowEnd = config->rateWindowStart;
+		windowEnd.tv_sec++;
+		queue_resume(config, &windowEnd);
+	}
+}
+
+// Reads the message of a worker asking for its next connection
+void handle_worker_ready(PreforkWorker *worker) {
+	char ready;
+	ssize_t length = worker->channelFD < 0 ? -1 : recv(worker->channelFD, &ready, 1, MSG_DONTWAIT);
+	if (length == 0) {
+		close_worker_channel(worker->service, worker); // Exiting: it cannot take connections anymore
+	} else if (length > 0 && !worker->idle) {
+		worker->idle = true;
+		worker->service->idleWorkers++;
+		update_deferral(worker->service);
+	}
+}
+
+// Checks again the services of resumeQueue whose time has come
+void handle_resume_timer() {
+	uint64_t expirations;
+	if (read(resumeTimerFD, &expirations, sizeof(expirations)) < 0)
+		return; // Rearmed meanwhile
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	// Detach the expired ones first: checking them may queue them again
+	ServiceData *expired = resumeQueue;
+	ServiceData **last = &resumeQueue;
+	while (*last != NULL && !is_time_before(&now, &(*last)->resumeTime)) {
+		(*last)->resumeQueued = false;
+		last = &(*last)->nextResume;
+	}
+	resumeQueue = *last;
+	*last = NULL;
+	if (resumeQueue != NULL)
+		try_timerfd_start(resumeTimerFD, &resumeQueue->resumeTime);
+	while (expired != NULL) {
+		ServiceData *current = expired;
+		expired = current->nextResume;
+		if (current->acceptPaused && !is_time_before(&now, &current->acceptPausedUntil))
+			current->acceptPaused = false;
+		update_deferral(current);
+	}
+}
+
+// ============================ Worker restarts ============================
+// A dead worker of a 'prefork' or 'activate' service is started again at once
+// if it had been running for a while. One dying soon after starting (like a
+// missing binary) is started again after a delay, doubled by every fast
+// failure of the service workers and waited for on a timer watched by the
+// dispatcher. After too many fast failures the service is given up until the
+// configuration is reloaded.
+
+// Timer expiring when the next dead worker has to be started again
+int respawnTimerFD = -1;
+bool respawnTimerArmed = false;
+struct timespec nextRespawnTime;
+
+// Arms the respawn timer, unless it expires earlier already
+void schedule_respawn(struct timespec *time) {
+	if (respawnTimerArmed && !is_time_before(time, &nextRespawnTime))
+		return;
+	nextRespawnTime = *time;
+	respawnTimerArmed = true;
+	try_timerfd_start(respawnTimerFD, time);
+}
+
+// Starts a dead worker again, now or after the delay of the service fast failures
+void restart_worker(ServiceData *config, PreforkWorker *worker, pid_t deadPid, char **env) {
+	worker->pid = 0;
+	worker->channelFD = -1;
+	if (config->gaveUp)
+		return;
+	if (elapsed_seconds(&worker->startTime) >= WORKER_MIN_UPTIME_SECONDS) {
+		printf("Worker of %s died (PID %d); respawning it.\n", config->path, deadPid);
+		spawn_worker(config, worker, env);
+		return;
+	}
+
+	if (config->fastFailures == 0 || elapsed_seconds(&config->failureWindowStart) >= RESPAWN_WINDOW_SECONDS) {
+		config->fastFailures = 0;
+		clock_gettime(CLOCK_MONOTONIC, &config->failureWindowStart);
+	}
+	config->fastFailures++;
+	if (config->fastFailures >= RESPAWN_MAX_FAST_FAILURES) {
+		config->gaveUp = true;
+		fprintf(stderr, "Workers of %s failed %d times within %ds; giving up on the service until reloaded\n",
+			config->path, config->fastFailures, RESPAWN_WINDOW_SECONDS);
+		return;
+	}
+	long delay = RESPAWN_MIN_DELAY_MS;
+	for (int i = 1; i < config->fastFailures && delay < RESPAWN_MAX_DELAY_MS; i++) {
+		delay *= 2;
+	}
+	if (delay > RESPAWN_MAX_DELAY_MS)
+		delay = RESPAWN_MAX_DELAY_MS;
+	clock_gettime(CLOCK_MONOTONIC, &worker->respawnTime);
+	add_milliseconds(&worker->respawnTime, delay);
+	worker->respawnPending = true;
+	schedule_respawn(&worker->respawnTime);
+	printf("Worker of %s died soon after starting (PID %d); respawning it in %ldms.\n",
+		config->path, deadPid, delay);
+}
+
+// Starts the dead workers whose delay has expired and arms the timer for the next ones
+void handle_respawn_timer(ServiceDataVector *config, char **env) {
+	uint64_t expirations;
+	if (read(respawnTimerFD, &expirations, sizeof(expirations)) < 0)
+		return; // Disarmed meanwhile
+	respawnTimerArmed = false;
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	for (size_t i = 0; i < config->size; i++) {
+		ServiceData *current = &config->services[i];
+		for (int w = 0; w < current->workerCount && current->workers != NULL; w++) {
+			PreforkWorker *worker = &current->workers[w];
+			if (!worker->respawnPending)
+				continue;
+			if (current->gaveUp) {
+				worker->respawnPending = false;
+			} else if (is_time_before(&now, &worker->respawnTime)) {
+				schedule_respawn(&worker->respawnTime);
+			} else {
+				spawn_worker(current, worker, env);
+			}
+		}
+	}
+}
+
+// ============================== Statistics ===============================
+// Reported by the internal:stats service and printed on SIGUSR1.
+
+void write_service_statistics(FILE *output, ServiceData *config) {
+	AcceptStats *accept = &config->acceptStats;
+	ChildStats *child = config->childStats;
+	fprintf(output, "%s %s:%s (%s)\n", config->path, config->protocol, config->port, config->mode);
+	fprintf(output, "  accepted: %lu in %lu wakeups (%.2f per wakeup, max %lu)",
+		accept->connections, accept->wakeups,
+		accept->wakeups == 0 ? 0 : (double)accept->connections / accept->wakeups, accept->maxBatch);
+	if (is_service_tcp(config))
+		fprintf(output, ", backlog %d, max queued %lu, queue full %lu times",
+			config->backlog, accept->maxQueued, accept->queueFull);
+	fprintf(output, "\n");
+	if (config->internal != INTERNAL_NONE)
+		return;
+
+	if (config->workerCount > 0) {
+		int running = 0;
+		for (int w = 0; w < config->workerCount && config->workers != NULL; w++) {
+			if (config->workers[w].pid != 0)
+				running++;
+		}
+		fprintf(output, "  workers: %d of %d running%s\n", running, config->workerCount,
+			config->gaveUp ? " (given up)" : "");
+	}
+	fprintf(output, "  active children: %d, forks: %lu, exec failures: %lu\n",
+		config->children.count, child->forks, child->execFailures);
+	double deferred = child->deferredSeconds;
+	if (config->deferred)
+		deferred += elapsed_seconds(&child->deferredSince);
+	fprintf(output, "  deferred: %lu times, %.3fs%s\n", child->deferrals, deferred,
+		config->deferred ? " (now deferred)" : "");
+	fprintf(output, "  fork latency:");
+	for (int i = 0; i < FORK_LATENCY_BUCKETS; i++) {
+		if (child->forkLatency[i] == 0)
+			continue;
+		if (i < FORK_LATENCY_BUCKETS - 1)
+			fprintf(output, " <%luus:%lu", 1UL << i, child->forkLatency[i]);
+		else
+			fprintf(output, " >=%luus:%lu", 1UL << (i - 1), child->forkLatency[i]);
+	}
+	fprintf(output, "\n  exit codes:");
+	for (int code = 0; code < EXIT_CODES_COUNT; code++) {
+		if (child->exitCodes[code] != 0)
+			fprintf(output, " %d:%lu", code, child->exitCodes[code]);
+	}
+	fprintf(output, " signal:%lu\n", child->killed);
+}
+
+void write_statistics(FILE *output, ServiceDataVector *config) {
+	fprintf(output, "Statistics of dispatcher PID %d\n", getpid());
+	for (size_t i = 0; i < config->size; i++) {
+		write_service_statistics(output, &config->services[i]);
+	}
+	long overflows = read_listen_overflows();
+	if (overflows >= 0)
+		fprintf(output, "System-wide listen queue overflows: %ld\n", overflows);
+}
+
+// =========================== Internal services ===========================
+// Internal services run inside the superserver on non-blocking sockets,
+// without any fork: UDP ones answer each datagram directly, TCP ones keep
+// an InternalConnection watched by the dispatcher.
+
+// Running services, reported by internal:stats
+ServiceDataVector *runningServices = NULL;
+
+// Connections accepted and datagrams handled by this process: points to the
+// shared counter of the dispatcher when running with --workers
+unsigned long localAccepts = 0;
+unsigned long *acceptCount = &localAccepts;
+
+// Writes the current time as a human readable line (daytime protocol)
+size_t write_daytime(char *buffer, size_t size) {
+	time_t now = time(NULL);
+	return strftime(buffer, size, "%A, %B %d, %Y %H:%M:%S-%Z\r\n", localtime(&now));
+}
+
+// Writes chargen lines starting from the given character offset and returns the
+// number of bytes written; the offset is updated for the next call.
+size_t write_chargen(char *buffer, size_t size, int *offset) {
+	const int printableCount = 95; // Printable ASCII characters, from ' ' to '~'
+	size_t length = 0;
+	while (length + CHARGEN_LINE_LENGTH + 2 <= size) {
+		for (int i = 0; i < CHARGEN_LINE_LENGTH; i++) {
+			buffer[length++] = ' ' + (*offset + i) % printableCount;
+		}
+		buffer[length++] = '\r';
+		buffer[length++] = '\n';
+		*offset = (*offset + 1) % printableCount;
+	}
+	return length;
+}
+
+void convert_to_upper_case(char *buffer, size_t length) {
+	for (size_t i = 0; i < length; i++) {
+		buffer[i] = toupper(buffer[i]);
+	}
+}
+
+// Answers the datagrams waiting on the socket of a UDP internal service
+void handle_internal_datagrams(ServiceData *config) {
+	static char buffer[MAX_DATAGRAM_SIZE]; // Any UDP datagram fits, so none is truncated
+	struct sockaddr_in clientAddr;
+	for (int i = 0; i < INTERNAL_DATAGRAMS_PER_WAKEUP; i++) {
+		socklen_t clientAddrLength = sizeof(clientAddr);
+		ssize_t length = recvfrom(config->socketFD, buffer, sizeof(buffer), MSG_DONTWAIT,
+			(struct sockaddr*)&clientAddr, &clientAddrLength);
+		if (length < 0)
+			return; // Nothing else to read
+		(*acceptCount)++;
+		config->acceptStats.wakeups++;
+		config->acceptStats.connections++;
+		int chargenOffset = 0;
+		switch (config->internal) {
+			case INTERNAL_UPPER:
+				convert_to_upper_case(buffer, length);
+				break;
+			case INTERNAL_DISCARD:
+				continue;
+			case INTERNAL_CHARGEN:
+				length = write_chargen(buffer, rand() % CHARGEN_MAX_DATAGRAM_SIZE, &chargenOffset);
+				break;
+			case INTERNAL_DAYTIME:
+				length = write_daytime(buffer, sizeof(buffer));
+				break;
+			default:
+				break;
+		}
+		sendto(config->socketFD, buffer, length, MSG_DONTWAIT,
+			(struct sockaddr*)&clientAddr, clientAddrLength);
+	}
+}
+
+void close_internal_connection(InternalConnection *connection) {
+	dispatcher_ignore(connection->socketFD);
+	try_close(connection->socketFD);
+	if (connection->output != connection->buffer)
+		free(connection->output);
+	free(connection);
+}
+
+// Sends the pending output of a connection. Returns false if the connection has
+// been closed, otherwise the dispatcher reports it as writable while output is pending.
+bool flush_internal_connection(InternalConnection *connection) {
+	while (connection->pendingStart < connection->pendingEnd) {
+		ssize_t sent = send(connection->socketFD, connection->output + connection->pendingStart,
+			connection->pendingEnd - connection->pendingStart, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (sent < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				close_internal_connection(connection);
+				return false;
+			}
+			dispatcher_watch_output(connection->socketFD, connection, true);
+			return true;
+		}
+		connection->pendingStart += sent;
+	}
+	connection->pendingStart = connection->pendingEnd = 0;
+	if (connection->closeWhenFlushed) {
+		close_internal_connection(connection);
+		return false;
+	}
+	if (connection->internal != INTERNAL_CHARGEN) // Chargen always wants to write
+		dispatcher_watch_output(connection->socketFD, connection, false);
+	return true;
+}
+
+// Handles the activity on a TCP connection of an internal service
+void handle_internal_connection(InternalConnection *connection) {
+	// Do not read more until the previous output has been sent
+	if (!flush_internal_connection(connection) || connection->pendingEnd > 0)
+		return;
+
+	if (connection->internal == INTERNAL_CHARGEN) {
+		connection->pendingEnd = write_chargen(connection->buffer, INTERNAL_BUFFER_SIZE, &connection->chargenOffset);
+		if (!flush_internal_connection(connection))
+			return;
+	}
+
+	ssize_t length = recv(connection->socketFD, connection->buffer + connection->pendingEnd,
+		INTERNAL_BUFFER_SIZE - connection->pendingEnd, MSG_DONTWAIT);
+	if (length == 0 || (length < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+		close_internal_connection(connection);
+		return;
+	}
+	if (length < 0 || connection->internal == INTERNAL_DISCARD || connection->internal == INTERNAL_CHARGEN)
+		return;
+
+	if (connection->internal == INTERNAL_UPPER)
+		convert_to_upper_case(connection->buffer, length);
+	connection->pendingEnd = length;
+	flush_internal_connection(connection);
+}
+
+// Starts serving an accepted connection of an internal service
+void start_internal_connection(ServiceData *config, int connectionFD) {
+	InternalConnection *connection = (InternalConnection*)malloc(sizeof(InternalConnection));
+	connection->sourceType = SOURCE_CONNECTION;
+	connection->socketFD = connectionFD;
+	connection->internal = config->internal;
+	connection->output = connection->buffer;
+	connection->pendingStart = connection->pendingEnd = 0;
+	connection->closeWhenFlushed = false;
+	connection->chargenOffset = 0;
+	dispatcher_watch(connectionFD, connection);
+
+	if (config->internal == INTERNAL_DAYTIME) { // Daytime answers and closes immediately
+		connection->pendingEnd = write_daytime(connection->buffer, INTERNAL_BUFFER_SIZE);
+		connection->closeWhenFlushed = true;
+		flush_internal_connection(connection);
+	} else if (config->internal == INTERNAL_STATS) { // Same for stats, with a longer answer
+		FILE *report = open_memstream(&connection->output, &connection->pendingEnd);
+		write_statistics(report, runningServices);
+		fclose(report);
+		connection->closeWhenFlushed = true;
+		flush_internal_connection(connection);
+	} else if (config->internal == INTERNAL_CHARGEN) {
+		dispatcher_watch_output(connectionFD, connection, true);
+	}
+}
+
+// Handles a connection request for an internal service
+void handle_internal_service(ServiceData *config) {
+	if (!is_service_tcp(config)) {
+		handle_internal_datagrams(config);
+		return;
+	}
+
+	int connectionFD;
+	unsigned long accepted = 0;
+	start_accept_batch(config);
+	while ((connectionFD = try_accept(config, get_accept_flags(config))) >= 0) {
+		accepted++;
+		(*acceptCount)++;
+		start_internal_connection(config, connectionFD);
+	}
+	end_accept_batch(config, accepted);
+	if (config->acceptPaused)
+		update_deferral(config); // Out of descriptors or memory: stop watching the socket for a while
+}
+
+// ============================= UDP requests ==============================
+// A 'nowait' UDP service does not hand its own socket to the children: that
+// way every child competes for the same queue, and the superserver keeps
+// forking until one of them reads the datagram. The superserver reads the
+// datagram itself and passes it to the child on its standard input, a
+// SOCK_SEQPACKET socket that ends after it. The child answers on its standard
+// output, a UDP socket connected to the sender from a port of its own, as
+// TFTP servers do: the rest of the exchange goes straight to the child.
+
+char datagramBuffer[MAX_DATAGRAM_SIZE];
+
+bool is_udp_request_per_peer(ServiceData *config) {
+	return !is_service_tcp(config) && !is_service_wait(config);
+}
+
+// Reads a datagram from the service socket into datagramBuffer without blocking.
+// Returns its length, or -1 if there is none.
+ssize_t receive_datagram(ServiceData *config, struct sockaddr_in *peer, struct in_addr *local) {
+	char control[CMSG_SPACE(sizeof(struct in_pktinfo))];
+	struct iovec data = { datagramBuffer, MAX_DATAGRAM_SIZE };
+	struct msghdr message = { 0 };
+	message.msg_name = peer;
+	message.msg_namelen = sizeof(*peer);
+	message.msg_iov = &data;
+	message.msg_iovlen = 1;
+	message.msg_control = control;
+	message.msg_controllen = sizeof(control);
+	ssize_t length = recvmsg(config->socketFD, &message, MSG_DONTWAIT);
+	if (length < 0)
+		return -1;
+
+	local->s_addr = INADDR_ANY;
+	for (struct cmsghdr *header = CMSG_FIRSTHDR(&message); header != NULL;
+		header = CMSG_NXTHDR(&message, header)) {
+		if (header->cmsg_level == IPPROTO_IP && header->cmsg_type == IP_PKTINFO)
+			*local = ((struct in_pktinfo*)CMSG_DATA(header))->ipi_addr;
+	}
+	return length;
+}
+
+// Opens a socket connected to `peer` from the address it used, on a new port;
+// returns -1 on errors
+int open_peer_socket(struct sockaddr_in *peer, struct in_addr local) {
+	int socketFD = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, IPPROTO_UDP);
+	if (socketFD < 0)
+		return -1;
+	struct sockaddr_in localAddr = { 0 };
+	localAddr.sin_family = AF_INET;
+	localAddr.sin_addr = local; // Answer from the address the peer used
+	if (bind(socketFD, (struct sockaddr*)&localAddr, sizeof(localAddr)) < 0 ||
+		connect(socketFD, (struct sockaddr*)peer, sizeof(*peer)) < 0) {
+		close(socketFD);
+		return -1;
+	}
+	return socketFD;
+}
+
+// Returns a socket holding the datagram in datagramBuffer, then the end of
+// the input; -1 on errors
+int open_datagram_input(size_t length) {
+	int pair[2];
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, pair) < 0)
+		return -1;
+	bool queued = send(pair[0], datagramBuffer, length, MSG_DONTWAIT) == (ssize_t)length;
+	close(pair[0]);
+	if (!queued) {
+		close(pair[1]);
+		return -1;
+	}
+	return pair[1];
+}
+
+// Serves a request: `receiveSocketFD` is the accepted connection for TCP
+// services and the service socket itself for 'wait' UDP ones, and it is also
+// the output of the child unless `outputSocketFD` is another one (see above)
+void handle_request(ServiceData* config, int receiveSocketFD, int outputSocketFD, char **env){
+	(*acceptCount)++;
+	printf("Handling service %s on %s port %s ('%s' mode).",
+		config->path, config->protocol, config->port, config->mode);
+
+	if (is_service_prefork(config)) {
+		pid_t workerPid = hand_to_worker(config, receiveSocketFD);
+		if (workerPid != 0) {
+			printf(" Handed to worker PID %d\n", workerPid);
+		} else {
+			printf(" No worker available; connection dropped\n");
+		}
+		try_close(receiveSocketFD);
+		update_deferral(config); // No worker left idle: leave the next ones queued
+		return;
+	}
+
+	struct timespec forkStart;
+	clock_gettime(CLOCK_MONOTONIC, &forkStart);
+	pid_t pid = spawn_service(receiveSocketFD, outputSocketFD, STDERR_FILENO, config, env);
+	record_fork(config->childStats, elapsed_seconds(&forkStart));
+	add_child(&config->children, pid);
+	printf(" Child PID is %d", pid);
+	if (receiveSocketFD != config->socketFD) {
+		try_close(receiveSocketFD); // Close the socket of the request
+	}
+	if (outputSocketFD != receiveSocketFD) {
+		try_close(outputSocketFD);
+	}
+	count_request(config);
+	update_deferral(config);
+	if (config->deferred)
+		printf("; ignoring other socket activity.");
+	printf("\n");
+}
+
+// Serves the datagrams queued on a 'nowait' UDP service, one child per datagram
+void handle_udp_requests(ServiceData *config, char **env) {
+	config->acceptStats.wakeups++;
+	for (int i = 0; i < UDP_REQUESTS_PER_WAKEUP && !config->deferred; i++) {
+		struct sockaddr_in peer;
+		struct in_addr local;
+		ssize_t length = receive_datagram(config, &peer, &local);
+		if (length < 0)
+			return; // Nothing else to read
+		config->acceptStats.connections++;
+
+		int peerSocketFD = open_peer_socket(&peer, local);
+		int inputFD = peerSocketFD >= 0 ? open_datagram_input(length) : -1;
+		if (inputFD < 0) {
+			fprintf(stderr, "Datagram for %s dropped: %s\n", config->path, strerror(errno));
+			if (peerSocketFD >= 0)
+				try_close(peerSocketFD);
+			continue;
+		}
+		handle_request(config, inputFD, peerSocketFD, env);
+	}
+}
+
+// Handles a connection request for a service
+void handle_service(ServiceData* config, char **env){
+	if (config->internal != INTERNAL_NONE) {
+		handle_internal_service(config);
+		return;
+	}
+	if (is_udp_request_per_peer(config)) {
+		handle_udp_requests(config, env);
+		return;
+	}
+	if (!is_service_tcp(config)) {
+		config->acceptStats.wakeups++;
+		config->acceptStats.connections++;
+		handle_request(config, config->socketFD, config->socketFD, env);
+		return;
+	}
+
+	// Drain the accept queue until the service reaches its limits
+	int connectionFD;
+	unsigned long accepted = 0;
+	start_accept_batch(config);
+	while (!config->deferred && (connectionFD = try_accept(config, get_accept_flags(config))) >= 0) {
+		accepted++;
+		handle_request(config, connectionFD, connectionFD, env);
+	}
+	end_accept_batch(config, accepted);
+	if (config->acceptPaused)
+		update_deferral(config); // Out of descriptors or memory: stop watching the socket for a while
+}
+
+// Serves a connection the dispatcher accepted by itself (see dispatcher_watch_accept).
+// Each one is counted as a wakeup: the accept queue is not sampled.
+void handle_accepted_connection(ServiceData *config, int connectionFD, char **env) {
+	reportedAcceptError = 0;
+	config->acceptStats.wakeups++;
+	end_accept_batch(config, 1);
+	if (config->internal != INTERNAL_NONE) {
+		(*acceptCount)++;
+		start_internal_connection(config, connectionFD);
+	} else {
+		handle_request(config, connectionFD, connectionFD, env);
+	}
+}
+
+// ========================= Configuration reload ==========================
+// On SIGHUP the configuration file is read again and compared with the running
+// services by (protocol, port): unchanged services keep their socket (and their
+// listen queue), new ones are opened and removed ones are closed, after their
+// 'wait' child exits. If the new configuration cannot be read or a new socket
+// cannot be opened, nothing changes.
+
+// Removed services whose 'wait' child is still running
+ServiceDataVector retiredServices = { 0, NULL };
+
+// Index of a service endpoint in a table of 2 * (PORT_MAX + 1) entries
+size_t endpoint_index(ServiceData *config) {
+	return atoi(config->port) * 2 + (is_service_tcp(config) ? 1 : 0);
+}
+
+// Terminates the workers of a 'prefork' service
+void stop_workers(ServiceData *config) {
+	for (int w = 0; w < config->workerCount && config->workers != NULL; w++) {
+		if (config->workers[w].pid != 0) {
+			kill(config->workers[w].pid, SIGTERM);
+			close_worker_channel(config, &config->workers[w]);
+		}
+	}
+	free(config->workers);
+	config->workers = NULL;
+}
+
+// Checks if a running 'prefork' or 'activate' service can keep its workers in the updated configuration
+// (a service given up is started again: the reload may have fixed it)
+bool can_keep_workers(ServiceData *running, ServiceData *updated) {
+	return running->workerCount > 0 && !running->gaveUp && strcmp(running->mode, updated->mode) == 0 &&
+		strcmp(running->path, updated->path) == 0 && running->workerCount == updated->workerCount;
+}
+
+// Moves the runtime state of a running service to its updated configuration
+void transfer_service(ServiceData *running, ServiceData *updated) {
+	updated->socketFD = running->socketFD;
+	updated->deferred = running->deferred && !is_service_activated(updated);
+	updated->rateWindowStart = running->rateWindowStart;
+	updated->rateCount = running->rateCount;
+	updated->acceptStats = running->acceptStats;
+	free(updated->childStats);
+	updated->childStats = running->childStats;
+	updated->children = running->children;
+	running->childStats = NULL;
+	running->children.pids = NULL;
+	if (is_service_tcp(updated) && updated->backlog != running->backlog)
+		listen(updated->socketFD, updated->backlog); // Only resizes the accept queue
+	if (is_socket_nonblocking(updated) != is_socket_nonblocking(running)) {
+		int flags = fcntl(updated->socketFD, F_GETFL);
+		fcntl(updated->socketFD, F_SETFL, is_socket_nonblocking(updated) ? flags | O_NONBLOCK : flags & ~O_NONBLOCK);
+	}
+	if (can_keep_workers(running, updated)) {
+		updated->workers = running->workers;
+		updated->nextWorker = running->nextWorker;
+		updated->idleWorkers = running->idleWorkers;
+		for (int w = 0; w < updated->workerCount; w++) {
+			updated->workers[w].service = updated;
+		}
+		updated->fastFailures = running->fastFailures;
+		updated->failureWindowStart = running->failureWindowStart;
+		running->workers = NULL;
+	} else {
+		stop_workers(running);
+	}
+}
+
+// Closes a service which is no longer in the configuration
+void remove_service(ServiceData *config) {
+	stop_workers(config);
+	if (is_service_wait(config) && config->children.count > 0) { // Keep the socket until the child exits
+		retiredServices.services = (ServiceData*)realloc(retiredServices.services,
+			(retiredServices.size + 1) * sizeof(ServiceData));
+		retiredServices.services[retiredServices.size++] = *config;
+		config->childStats = NULL; // Now owned by the retired copy
+		config->children.pids = NULL;
+		return;
+	}
+	if (is_service_watched(config))
+		dispatcher_ignore(config->socketFD);
+	try_close(config->socketFD);
+}
+
+// Closes the socket of a retired service when its 'wait' child exits.
+// Returns false if the child does not belong to a retired service.
+bool close_retired_service(pid_t childPid) {
+	for (size_t i = 0; i < retiredServices.size; i++) {
+		if (remove_child(&retiredServices.services[i].children, childPid)) {
+			printf("Removed service %s finished (PID %d); socket closed.\n",
+				retiredServices.services[i].path, childPid);
+			try_close(retiredServices.services[i].socketFD);
+			free(retiredServices.services[i].childStats);
+			free(retiredServices.services[i].children.pids);
+			retiredServices.services[i] = retiredServices.services[--retiredServices.size];
+			return true;
+		}
+	}
+	return false;
+}
+
+// Reads the configuration file again and applies the differences
+void reload_configuration(ServiceDataVector *config, bool reusePort, char **env) {
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	ServiceDataVector updated;
+	int error = load_server_configuration(&updated);
+	if (error != 0) {
+		print_error(error);
+		fprintf(stderr, "Configuration not reloaded\n");
+		return;
+	}
+
+	// Map every running endpoint to its service (index + 1, 0 if none)
+	size_t *runningIndex = (size_t*)calloc(2 * (PORT_MAX + 1), sizeof(size_t));
+	for (size_t i = 0; i < config->size; i++) {
+		runningIndex[endpoint_index(&config->services[i])] = i + 1;
+	}
+
+	// Match the updated services with the running ones and open the new sockets
+	ServiceData **running = (ServiceData**)calloc(updated.size, sizeof(ServiceData*));
+	size_t opened = 0;
+	for (size_t i = 0; i < updated.size && error == 0; i++) {
+		size_t *index = &runningIndex[endpoint_index(&updated.services[i])];
+		if (*index != 0) {
+			running[i] = &config->services[*index - 1];
+			*index = 0; // Each running service is matched at most once
+		} else {
+			error = open_service(&updated.services[i], reusePort);
+			if (error == 0)
+				opened++;
+		}
+	}
+	if (error != 0) { // Roll back: close the sockets opened so far
+		for (size_t i = 0; i < updated.size && opened > 0; i++) {
+			if (running[i] == NULL) {
+				try_close(updated.services[i].socketFD);
+				opened--;
 			}
-			// Add the service socket back to the select set
-			for (size_t i = 0; i < config.size; i++) {
-				if (config.services[i].pid == childPid) {
-					FD_SET(config.services[i].socketFD, &socketsSet);
-					config.services[i].pid = 0;
-					printf("Service %s finished (PID %d); socket activity no longer ignored.\n",
-						config.services[i].path, childPid);
+		}
+		fprintf(stderr, "Configuration not reloaded\n");
+		free(running);
+		free(runningIndex);
+		free_services(&updated);
+		return;
+	}
+
+	// From now on the new configuration is applied
+	size_t kept = 0, removed = 0;
+	for (size_t i = 0; i < updated.size; i++) {
+		if (running[i] != NULL) {
+			if (is_service_watched(running[i])) // It will be watched again with its new data
+				dispatcher_ignore(running[i]->socketFD);
+			transfer_service(running[i], &updated.services[i]);
+			kept++;
+		}
+	}
+	for (size_t i = 0; i < config->size; i++) {
+		if (runningIndex[endpoint_index(&config->services[i])] != 0) { // Not matched
+			remove_service(&config->services[i]);
+			removed++;
+		}
+	}
+	free(running);
+	free(runningIndex);
+	free_services(config);
+	*config = updated;
+	resumeQueue = NULL; // Filled again below: the services have moved
+
+	for (size_t i = 0; i < config->size; i++) {
+		if (is_service_watched(&config->services[i]))
+			watch_service(&config->services[i]);
+		update_deferral(&config->services[i]); // The limits may have changed
+	}
+	initialize_all_workers(config, env);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	printf("Configuration reloaded in %.3fms: %zu services kept, %zu opened, %zu removed\n",
+		(end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6, kept, opened, removed);
+}
+
+// Updates the services after the termination of one of their children
+void handle_child_exit(ServiceDataVector *config, pid_t childPid, int childStatus, char **env) {
+	printf("PID %d exited\n", childPid);
+	if (WEXITSTATUS(childStatus) != 0) {
+		fprintf(stderr, "A child with PID %d exited with code %d\n", childPid, WEXITSTATUS(childStatus));
+		print_error(WEXITSTATUS(childStatus));
+	}
+	if (close_retired_service(childPid))
+		return;
+	for (size_t i = 0; i < config->size; i++) {
+		ServiceData *current = &config->services[i];
+		if (remove_child(&current->children, childPid)) {
+			record_child_exit(current->childStats, childStatus);
+			bool wasDeferred = current->deferred;
+			update_deferral(current); // Watch the service socket again if under its limits
+			if (wasDeferred && !current->deferred)
+				printf("Service %s finished (PID %d); socket activity no longer ignored.\n",
+					current->path, childPid);
+			return;
+		}
+		// Restart dead 'prefork' workers and 'activate' services
+		for (int w = 0; w < current->workerCount; w++) {
+			if (current->workers[w].pid == childPid) {
+				record_child_exit(current->childStats, childStatus);
+				close_worker_channel(current, &current->workers[w]);
+				restart_worker(current, &current->workers[w], childPid, env);
+				update_deferral(current); // It may have been the last idle worker
+				return;
+			}
+		}
+	}
+}
+
+// Reaps every terminated child: a single SIGCHLD may stand for many exits
+void reap_children(ServiceDataVector *config, char **env) {
+	int childStatus;
+	pid_t childPid;
+	while ((childPid = try_reap(&childStatus)) > 0) {
+		handle_child_exit(config, childPid, childStatus, env);
+	}
+}
+
+// Handles the signals read from the signal descriptor. A reload request is only
+// recorded in `reloadRequested`, so that it is applied between two dispatcher waits.
+void handle_signals(int signalFD, ServiceDataVector *config, bool *reloadRequested, char **env) {
+	struct signalfd_siginfo info;
+	bool childExited = false;
+	while (read(signalFD, &info, sizeof(info)) == sizeof(info)) { // Drain pending signals
+		switch (info.ssi_signo) {
+			case SIGCHLD:
+				childExited = true;
+				break;
+			case SIGHUP:
+				*reloadRequested = true;
+				break;
+			case SIGUSR1:
+				write_statistics(stdout, config);
+				break;
+			default:
+				printf("Signal not known!\n");
+				break;
+		}
+	}
+	if (childExited) {
+		reap_children(config, env);
+	}
+}
+
+void main_loop(ServiceDataVector *config, int signalFD, bool reusePort, char **env){
+	SourceType signalSource = SOURCE_SIGNAL;
+	SourceType timerSource = SOURCE_TIMER;
+	SourceType resumeTimerSource = SOURCE_RESUME_TIMER;
+	dispatcher_watch(signalFD, &signalSource);
+	dispatcher_watch(respawnTimerFD, &timerSource);
+	dispatcher_watch(resumeTimerFD, &resumeTimerSource);
+	runningServices = config;
+
+	void *ready[MAX_READY_SOURCES];
+	int accepted[MAX_READY_SOURCES];
+	bool reloadRequested = false;
+	while(true) {
+		// Ready sources may point into the configuration: reload only between waits
+		if (reloadRequested) {
+			reloadRequested = false;
+			reload_configuration(config, reusePort, env);
+		}
+		// A count of 0 means it has been interrupted by a signal
+		int count = dispatcher_wait(ready, accepted, MAX_READY_SOURCES, -1);
+		for (int i = 0; i < count; i++) {
+			switch (*(SourceType*)ready[i]) {
+				case SOURCE_SERVICE:
+					if (accepted[i] >= 0)
+						handle_accepted_connection((ServiceData*)ready[i], accepted[i], env);
+					else
+						handle_service((ServiceData*)ready[i], env);
+					break;
+				case SOURCE_SIGNAL:
+					handle_signals(signalFD, config, &reloadRequested, env);
+					break;
+				case SOURCE_TIMER:
+					handle_respawn_timer(config, env);
+					break;
+				case SOURCE_RESUME_TIMER:
+					handle_resume_timer();
+					break;
+				case SOURCE_WORKER:
+					handle_worker_ready((PreforkWorker*)ready[i]);
+					break;
+				case SOURCE_CONNECTION:
+					handle_internal_connection((InternalConnection*)ready[i]);
 					break;
-				}
 			}
-			break;
-		default:
-			printf("Signal not known!\n");
-			break;
+		}
+	}
+}
+
+// Runs a dispatcher serving all the services; never returns
+void run_dispatcher(ServiceDataVector *config, bool reusePort, char **env) {
+	dispatcher_initialize();
+	initialize_all_services(config, reusePort);
+
+	// Signals sent by son processes and reload requests are read in the main loop
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGCHLD);
+	sigaddset(&signals, SIGHUP);
+	sigaddset(&signals, SIGUSR1);
+	int signalFD = try_signalfd(&signals, &childSignalMask);
+
+	respawnTimerFD = try_timerfd_create();
+	resumeTimerFD = try_timerfd_create();
+	initialize_all_workers(config, env);
+	for (size_t i = 0; i < config->size; i++) {
+		update_deferral(&config->services[i]); // 'prefork' services wait for an idle worker
+	}
+
+	main_loop(config, signalFD, reusePort, env);
+}
+
+// ========================== Dispatcher processes =========================
+// With --workers N the superserver forks N dispatchers, each pinned to a CPU
+// and binding its own SO_REUSEPORT socket for every service. The master only
+// restarts dead dispatchers, forwards SIGHUP to them and prints their accept
+// counters on SIGUSR1 (forwarding it as well).
+
+// Reads the number of dispatcher processes from the command line (0 if not given)
+int read_workers_option(int argc, char **argv) {
+	if (argc == 1)
+		return 0;
+	if (argc != 3 || strcmp(argv[1], WORKERS_OPTION) != 0)
+		die(EXIT_USAGE_ERROR);
+	for (char *c = argv[2]; *c != '\0'; c++) {
+		if (!isdigit(*c))
+			die(EXIT_USAGE_ERROR);
+	}
+	int workers = atoi(argv[2]);
+	if (workers <= 0 || workers > MAX_DISPATCHERS)
+		die(EXIT_USAGE_ERROR);
+	return workers;
+}
+
+DispatcherProcess *allocate_dispatchers(int count) {
+	void *memory = mmap(NULL, count * sizeof(DispatcherProcess), PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (memory == MAP_FAILED)
+		die(EXIT_SHARED_MEMORY_ERROR);
+	return (DispatcherProcess*)memory;
+}
+
+// Forks a dispatcher pinned to its CPU
+void spawn_dispatcher(DispatcherProcess *dispatcher, ServiceDataVector *config,
+	sigset_t *originalMask, char **env) {
+	fflush(stdout); // The child keeps running: do not duplicate buffered output
+	pid_t pid = try_fork();
+	if (pid == 0) { // In the child
+		prctl(PR_SET_PDEATHSIG, SIGTERM); // Do not outlive the master
+		sigprocmask(SIG_SETMASK, originalMask, NULL);
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(dispatcher->cpu, &cpus);
+		if (sched_setaffinity(0, sizeof(cpus), &cpus) < 0)
+			perror("Cannot pin the dispatcher to its CPU");
+		acceptCount = &dispatcher->accepts;
+		run_dispatcher(config, true, env); // Never returns
+	}
+	dispatcher->pid = pid;
+	printf("Started dispatcher PID %d on CPU %d\n", pid, dispatcher->cpu);
+}
+
+void print_dispatcher_counters(DispatcherProcess *dispatchers, int count) {
+	unsigned long total = 0;
+	for (int i = 0; i < count; i++) {
+		total += dispatchers[i].accepts;
+	}
+	printf("Accepts per dispatcher (total %lu):\n", total);
+	for (int i = 0; i < count; i++) {
+		printf("  #%d PID %d CPU %d: %lu (%.1f%%)\n", i, dispatchers[i].pid, dispatchers[i].cpu,
+			dispatchers[i].accepts, total == 0 ? 0 : 100.0 * dispatchers[i].accepts / total);
 	}
 }
+
+// Reads the configuration again for the dispatchers started from now on
+void reload_master_configuration(ServiceDataVector *config) {
+	ServiceDataVector updated;
+	int error = load_server_configuration(&updated);
+	if (error != 0) {
+		print_error(error);
+		return;
+	}
+	free_services(config);
+	*config = updated;
+}
+
+// Starts the dispatchers and supervises them; never returns
+void run_master(ServiceDataVector *config, int count, char **env) {
+	sigset_t signals, originalMask;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGCHLD);
+	sigaddset(&signals, SIGUSR1);
+	sigaddset(&signals, SIGHUP);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	if (sigprocmask(SIG_BLOCK, &signals, &originalMask) < 0)
+		die(EXIT_SIGNAL_ERROR);
+
+	long cpuCount = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpuCount <= 0)
+		cpuCount = 1;
+	DispatcherProcess *dispatchers = allocate_dispatchers(count);
+	for (int i = 0; i < count; i++) {
+		dispatchers[i].cpu = i % cpuCount;
+		dispatchers[i].accepts = 0;
+		spawn_dispatcher(&dispatchers[i], config, &originalMask, env);
+	}
+
+	while (true) {
+		siginfo_t info;
+		if (sigwaitinfo(&signals, &info) < 0)
+			continue;
+		int childStatus;
+		pid_t childPid;
+		switch (info.si_signo) {
+			case SIGCHLD: // Restart the dead dispatchers
+				while ((childPid = try_reap(&childStatus)) > 0) {
+					for (int i = 0; i < count; i++) {
+						if (dispatchers[i].pid == childPid) {
+							fprintf(stderr, "Dispatcher PID %d exited with code %d; restarting it\n",
+								childPid, WEXITSTATUS(childStatus));
+							spawn_dispatcher(&dispatchers[i], config, &originalMask, env);
+						}
+					}
+				}
+				break;
+			case SIGUSR1: // The dispatchers print their own statistics
+				print_dispatcher_counters(dispatchers, count);
+				for (int i = 0; i < count; i++) {
+					kill(dispatchers[i].pid, SIGUSR1);
+				}
+				break;
+			case SIGHUP: // Restarted dispatchers must use the new configuration too
+				reload_master_configuration(config);
+				for (int i = 0; i < count; i++) {
+					kill(dispatchers[i].pid, SIGHUP);
+				}
+				break;
+			default: // Terminate along with the dispatchers
+				for (int i = 0; i < count; i++) {
+					kill(dispatchers[i].pid, SIGTERM);
+				}
+				print_dispatcher_counters(dispatchers, count);
+				exit(0);
+		}
+	}
+}
+
+#ifdef BENCH_RSS_MB
+// Memory the superserver touches at startup in benchmark builds, so that
+// bench-dispatch.py --spawn shows how spawning scales with its size
+char *benchMemory;
+#endif
+
+int main(int argc, char **argv, char **env) {
+	int workers = read_workers_option(argc, argv);
+#ifdef BENCH_RSS_MB
+	benchMemory = (char*)malloc((size_t)BENCH_RSS_MB << 20);
+	if (benchMemory == NULL) {
+		perror("Cannot allocate the benchmark memory");
+		exit(EXIT_FAILURE);
+	}
+	memset(benchMemory, 1, (size_t)BENCH_RSS_MB << 20);
+#endif
+
+	// Configuration loading
+	ServiceDataVector config = read_server_configuration();
+
+	if (workers == 0) {
+		run_dispatcher(&config, false, env);
+	} else {
+		run_master(&config, workers, env);
+	}
+
+	free_services(&config);
+	return 0;
+}
@@ -0,0 +1,31 @@
+#ifndef UPPER_ECHO_H
+#define UPPER_ECHO_H
+
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+// Connection handler shared by the example 'prefork' and 'activate' services.
+
+#define UPPER_ECHO_BUF_SIZE 1024
+
+// Echoes back in uppercase what the client sends, until it sends "exit";
+// then closes the connection.
+void upper_echo_connection(int socketFD) {
+	char buffer[UPPER_ECHO_BUF_SIZE];
+	ssize_t byteRecv;
+	while ((byteRecv = recv(socketFD, buffer, UPPER_ECHO_BUF_SIZE, 0)) > 0) {
+		if (strncmp(buffer, "exit", byteRecv) == 0)
+			break;
+		for (ssize_t i = 0; i < byteRecv; i++) {
+			buffer[i] = toupper(buffer[i]);
+		}
+		if (send(socketFD, buffer, byteRecv, MSG_NOSIGNAL) != byteRecv)
+			break;
+	}
+	close(socketFD);
+}
+
+#endif
@@ -1,4 +1,6 @@
+#define _GNU_SOURCE // sendmmsg, recvmmsg
 #include <stdio.h>
+#include <stdarg.h>
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
@@ -7,9 +9,21 @@
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <stdbool.h>
-#include <sys/time.h>
+#include <time.h>
 #include <ctype.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <endian.h>
+#include <sys/timerfd.h>
+#include <sys/prctl.h>
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
+
+#include "framing.h"
+#include "histogram.h"
 
 #define MAX_BUF_SIZE 1024
 #define PORT_MAX 65535
@@ -19,8 +33,46 @@
 #define MEAS_RTT_TYPE 1
 #define MAX_INT_VALUE 1e8
 #define MAX_INT_LENGTH 8
+#define OPTION_FRAMING "framing"
+#define OPTION_PROTOCOL "protocol"
+#define OPTION_RATE "rate"
+#define RATE_PPS_UNIT "pps"
+#define RATE_BPS_UNIT "bps"
+#define PACED_WINDOW 65536 // Probes in flight when pacing, if no window is given
+#define PROTOCOL_TCP_NAME "tcp"
+#define PROTOCOL_TCP 0
+#define PROTOCOL_UDP 1
+#define FRAMING_NEWLINE_NAME "newline"
+#define OPTION_WINDOW "window"
+#define OPTION_STREAMS "streams"
+#define OPTION_WARMUP "warmup"
+#define OPTION_SWEEP "sweep"
+#define SWEEP_FACTOR_PREFIX 'x'
+#define OPTION_TIMESTAMPS "timestamps"
+#define TIMESTAMPS_OFF_NAME "off"
+#define TIMESTAMPS_SOFTWARE_NAME "sw"
+#define TIMESTAMPS_HARDWARE_NAME "hw"
+#define TIMESTAMPS_OFF 0
+#define TIMESTAMPS_SOFTWARE 1
+#define TIMESTAMPS_HARDWARE 2 // Hardware timestamps where the NIC takes them, software ones elsewhere
+#define TIMESTAMP_CONTROL_SIZE 256 // Control data of a timestamped message
+#define MAX_STREAMS 256
+#define DATAGRAM_BATCH_SIZE 64 // UDP probes sent or received with one system call
+#define DATAGRAM_LOSS_TIMEOUT_MS 1000 // Probes not echoed in this time are lost
+#define DATAGRAM_SEND_TIMES_WINDOWS 4 // Send times kept, in windows: older probes are given up
+#define FORMAT_OPTION "--format"
+#define TRACE_OPTION "--trace"
+#define QUIET_OPTION "--quiet"
+#define FORMAT_TEXT_NAME "text"
+#define FORMAT_JSON_NAME "json"
+#define FORMAT_CSV_NAME "csv"
+#define FORMAT_TEXT 0
+#define FORMAT_JSON 1
+#define FORMAT_CSV 2
+#define TRACE_BUFFER_SIZE 4096 // Probes of a stream kept before being written to the trace file
 
 #define HELLO_OK_RESP "200 OK - Ready\n"
+#define HELLO_UDP_OK_PREFIX "200 OK - Ready " // Followed by the server UDP port
 #define HELLO_ERROR_RESP "404 ERROR - Invalid Hello message\n"
 #define MEASUREMENT_ERROR_RESP "404 ERROR - Invalid Measurement message\n"
 #define BYE_OK_RESP "200 OK - Closing\n"
@@ -34,21 +86,169 @@
 #define EXIT_SEND_ERROR 28
 #define EXIT_PARAMETERS_ERROR 29
 #define EXIT_RESPONSE_ERROR 30
+#define EXIT_POLL_ERROR 31
+#define EXIT_THREAD_ERROR 32
+#define EXIT_TIMER_ERROR 33
+#define EXIT_TIMESTAMPING_ERROR 34
+#define EXIT_TRACE_ERROR 35
 
 // General pourpose buffer
 char commonBuffer[MAX_BUF_SIZE];
 char *lastServerResponse;
-
-// Used to measure time
-struct timeval tm;
+// The measurement phases of all the streams start together
+pthread_barrier_t measurementStart;
+// Format of the results on standard output: with FORMAT_JSON and FORMAT_CSV
+// the progress messages go to standard error
+int outputFormat = FORMAT_TEXT;
+bool quiet = false; // No progress message for each probe
+// Every measured probe, written by the streams in batches
+FILE *traceFile = NULL;
+pthread_mutex_t traceLock = PTHREAD_MUTEX_INITIALIZER;
 
 typedef struct {
 	int measType;    // MEAS_THPUT_TYPE or MEAS_RTT_TYPE
 	int nProbes;     // Number of probes to calculate the desired measurement
 	int msgSize;     // The size of the measurement payload
 	int serverDelay; // Used to simulate network propagation delay
+	int framing;     // FRAMING_NEWLINE or FRAMING_LENGTH
+	int window;      // Maximum number of probes in flight
+	int streams;     // Number of connections measured in parallel
+	int warmup;      // Number of probes sent first and left out of the measurement
+	int protocol;    // PROTOCOL_TCP or PROTOCOL_UDP
+	double ratePps;  // Offered load of each stream in probes/s, or
+	double rateBps;  // in bits/s; 0 if the probes are not paced
+	int timestamps;  // TIMESTAMPS_OFF, TIMESTAMPS_SOFTWARE or TIMESTAMPS_HARDWARE
+	// Payload sizes measured one after the other, multiplying by the factor
+	// from the first to the last one; 0 if only msgSize is measured
+	int sweepMin;
+	int sweepMax;
+	double sweepFactor;
 } MeasurementConfig;
 
+// Result of all the streams with one payload size of a sweep
+typedef struct {
+	int msgSize;
+	unsigned long long probes;
+	double throughput; // kbps
+	uint64_t p50, p90, p99, p999, max; // RTTs in nanoseconds
+} SweepStep;
+
+// Schedule of the probes at a constant rate: probe i is due (i - 1) intervals
+// after the start. A probe is timed from when it is due, not from when it is
+// sent, so that a late send shows in the RTT (no coordinated omission).
+typedef struct {
+	double interval; // Nanoseconds; 0 if the probes are not paced
+	uint64_t start;
+	int timerFD;     // Expires when the next probe is due
+	int armedSeqNum; // Probe the timer is set for
+} Pacer;
+
+// When a packet left or arrived, according to the kernel (software) and to
+// the NIC (hardware), in nanoseconds; 0 if not reported. Software timestamps
+// are taken from the realtime clock, hardware ones from the clock of the NIC:
+// only the differences between timestamps of the same kind are meaningful.
+typedef struct {
+	uint64_t software;
+	uint64_t hardware;
+} KernelTime;
+
+typedef struct {
+	int seqNumber;
+	uint32_t key;    // Of the timestamp of the send of its last byte
+	KernelTime sent;
+} SentProbe;
+
+// Transmit timestamps of the probes in flight. They come from the error
+// queue of the socket, tagged with a key telling the send they belong to:
+// the number of datagrams sent before it for UDP, the offset of its last byte
+// for TCP (counted from when the timestamps were enabled).
+typedef struct {
+	int size;
+	SentProbe *probes;  // Indexed by sequence number modulo the size
+	int nextToRecord;   // Sequence number of the next probe sent
+	int nextToStamp;    // Sequence number of the oldest probe which may still get a timestamp
+} TransmitTimes;
+
+// What happened to the measured UDP probes
+typedef struct {
+	long long sent;
+	long long echoed;     // Distinct probes echoed
+	long long duplicates;
+	long long reordered;  // Echoed after a probe sent later
+	// Interarrival jitter of each direction (RFC 3550), in nanoseconds
+	double forwardJitter;
+	double returnJitter;
+} DatagramStats;
+
+// Times of a probe, for the trace file
+typedef struct {
+	int seqNumber;
+	uint64_t sendTime;    // Nanoseconds, monotonic clock
+	uint64_t receiveTime; // Of the echo
+} TraceRecord;
+
+// A connection to the server, with the thread running its session
+typedef struct {
+	int id;
+	int socketFD;
+	pthread_t thread;
+	MeasurementConfig config;
+	FrameBuffer received;      // Data received from the server, not handled yet
+	char buffer[MAX_BUF_SIZE]; // Hello and Bye messages
+	char label[16];            // Prefix of the log messages, empty with one stream
+	struct timespec start;     // When the first measured probe is sent
+	struct timespec end;       // When the last probe is echoed
+	Histogram rtts;            // Of the measured probes, in nanoseconds
+	long long totalBytes;      // Of the measured probes
+	int datagramFD;            // UDP probes, -1 if they go over TCP
+	DatagramStats datagrams;
+	// With kernel timestamps: the RTTs between the timestamps of the probes
+	// and of their echoes, and the rest of their RTTs
+	Histogram stackRtts;
+	Histogram overheads;
+	bool hardwareTimes;        // Some stack RTTs come from hardware timestamps
+	KernelTime lastReceived;   // Of the last data received over TCP
+	char control[TIMESTAMP_CONTROL_SIZE];
+	TraceRecord *trace;        // Probes not written to the trace file yet
+	int traceLength;
+} Stream;
+
+// Probes in flight during the measurement phase: they are echoed in order
+typedef struct {
+	int nextToSend;     // Sequence number of the probe being sent
+	int nextToReceive;  // Sequence number of the oldest probe not echoed yet
+	int size;           // Maximum number of probes in flight
+	char header[FRAME_HEADER_MAX_SIZE];
+	size_t headerLen;   // Header of the probe being sent
+	size_t sent;        // Bytes of the probe being sent already sent
+	uint64_t *sendTimes; // Nanoseconds, indexed by sequence number modulo the size
+	uint32_t bytesSent; // Since the measurement phase started
+	TransmitTimes transmitTimes;
+} ProbeWindow;
+
+// UDP probes in flight during the measurement phase: they are sent and
+// received in batches, and may be lost, duplicated or reordered
+typedef struct {
+	int nextToSend;
+	int inFlight;            // Probes sent, neither echoed nor given up
+	int size;                // Maximum number of probes in flight
+	int oldestPending;       // Older probes are echoed or given up
+	uint64_t *sendTimes;     // Nanoseconds, indexed by sequence number modulo sendTimesSize
+	int sendTimesSize;
+	int highestEchoed;
+	unsigned char *echoed;   // One bit for each sequence number
+	bool hasLast;            // Times of the last echo, for the jitter
+	uint64_t lastSend, lastEcho, lastReceive;
+	UdpProbeHeader headers[DATAGRAM_BATCH_SIZE];
+	struct iovec parts[DATAGRAM_BATCH_SIZE][2]; // Header and payload
+	struct mmsghdr probes[DATAGRAM_BATCH_SIZE];
+	char *buffers;
+	struct iovec buffered[DATAGRAM_BATCH_SIZE];
+	struct mmsghdr echoes[DATAGRAM_BATCH_SIZE];
+	char controls[DATAGRAM_BATCH_SIZE][TIMESTAMP_CONTROL_SIZE];
+	TransmitTimes transmitTimes;
+} DatagramWindow;
+
 // Terminates the program with a custom error code
 void die(int error) {
 	switch(error) {
@@ -56,7 +256,7 @@ void die(int error) {
 			perror("The creation of the socket was unsuccesful");
 			break;
 		case EXIT_INVALID_PORT:
-			fprintf(stderr, "Usage: client ADDRESS PORT");
+			fprintf(stderr, "Usage: client [--format text|json|csv] [--trace FILE] [--quiet] ADDRESS PORT");
 			break;
 		case EXIT_CONNECT_ERROR:
 			perror("Cannot connect to server");
@@ -76,6 +276,21 @@ void die(int error) {
 		case EXIT_RESPONSE_ERROR:
 			fprintf(stderr, "Error response from server: %s", lastServerResponse);
 			break;
+		case EXIT_POLL_ERROR:
+			perror("Cannot wait for the socket");
+			break;
+		case EXIT_THREAD_ERROR:
+			fprintf(stderr, "Cannot start the stream threads");
+			break;
+		case EXIT_TIMER_ERROR:
+			perror("Cannot set the pacing timer");
+			break;
+		case EXIT_TIMESTAMPING_ERROR:
+			perror("Cannot enable the kernel timestamps");
+			break;
+		case EXIT_TRACE_ERROR:
+			perror("Cannot write the trace file");
+			break;
 	}
 	exit(error);
 }
@@ -100,19 +315,42 @@ void try_connect(int socketFD, const char* address, int port) {
 		die(EXIT_CONNECT_ERROR);
 }
 
-void try_send(int socketFD, char *msg) {
-	int len = strlen(msg);
-	int res = send(socketFD, msg, len, MSG_NOSIGNAL);
-	if (res < len)
+// Probes are written whole: waiting to coalesce them with later ones
+// (Nagle) would delay pipelined and paced probes
+void try_disable_nagle(int socketFD) {
+	int value = 1;
+	if (setsockopt(socketFD, IPPROTO_TCP, TCP_NODELAY, &value, sizeof(value)) < 0)
+		die(EXIT_CONNECT_ERROR);
+}
+
+void try_send(int socketFD, char *msg, size_t len) {
+	ssize_t res = send(socketFD, msg, len, MSG_NOSIGNAL);
+	if (res < (ssize_t)len)
 		die(EXIT_SEND_ERROR);
 }
 
-size_t try_recv(int socketFD, char* buffer) {
-	size_t readCount = recv(socketFD, buffer, MAX_BUF_SIZE, 0);
-	if (readCount < 0) {
-		die(EXIT_RECV_ERROR);
+// Sends what the socket accepts without blocking; returns the number of bytes sent
+size_t try_send_available(int socketFD, struct iovec *parts, int count) {
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = parts;
+	msg.msg_iovlen = count;
+	ssize_t res = sendmsg(socketFD, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+	if (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+		return 0;
+	if (res < 0)
+		die(EXIT_SEND_ERROR);
+	return res;
+}
+
+// Returns the number of ready descriptors, 0 after `timeout` milliseconds
+int try_poll(struct pollfd *fds, nfds_t count, int timeout) {
+	int res;
+	while ((res = poll(fds, count, timeout)) < 0) {
+		if (errno != EINTR)
+			die(EXIT_POLL_ERROR);
 	}
-	return readCount;
+	return res;
 }
 
 void* try_malloc(size_t size) {
@@ -144,25 +382,279 @@ bool check_parameters(MeasurementConfig config) {
 		return false;
 	if (config.serverDelay < 0 || config.serverDelay > MAX_INT_VALUE)
 		return false;
+	if (config.warmup >= config.nProbes)
+		return false;
+	// UDP probes are echoed at once, in a single datagram
+	if (config.protocol == PROTOCOL_UDP && (config.serverDelay > 0 ||
+		config.msgSize > UDP_MAX_DATAGRAM - (int)sizeof(UdpProbeHeader)))
+		return false;
 	return true;
 }
 
+// Returns the number of probes which can be in flight
+int get_window_size(MeasurementConfig config) {
+	int size = config.window;
+	if (size == 0) // Not given: stop-and-wait, unless pacing
+		size = config.ratePps > 0 || config.rateBps > 0 ? PACED_WINDOW : 1;
+	return size < config.nProbes ? size : config.nProbes;
+}
+
 // Allocates the right amount of memory for a measurement message
 char* allocate_measurement_message(int msgSize) {
-	size_t totalSize = msgSize + MAX_INT_LENGTH + 10;
+	size_t totalSize = msgSize + FRAME_HEADER_MAX_SIZE;
 	return (char*)try_malloc(totalSize);
 }
 
-// Starts ther timer measurement
-void start_timer_us() {
-	gettimeofday(&tm, NULL);
+// Reads the monotonic clock, which is not changed by clock adjustments
+void get_time(struct timespec *time) {
+	clock_gettime(CLOCK_MONOTONIC, time);
+}
+
+// Returns the time elapsed from `start` to `end`, in nanoseconds
+long long interval_ns(struct timespec start, struct timespec end) {
+	return (end.tv_sec - start.tv_sec) * 1000000000LL + (end.tv_nsec - start.tv_nsec);
+}
+
+uint64_t to_ns(struct timespec time) {
+	return time.tv_sec * 1000000000ULL + time.tv_nsec;
+}
+
+struct timespec from_ns(uint64_t ns) {
+	struct timespec time = {(time_t)(ns / 1000000000ULL), (long)(ns % 1000000000ULL)};
+	return time;
+}
+
+uint64_t get_time_ns() {
+	struct timespec now;
+	get_time(&now);
+	return to_ns(now);
+}
+
+/* Pacing */
+
+// Starts the schedule of probes of `probeLen` bytes, if a rate is given
+void pacer_start(Pacer *pacer, MeasurementConfig config, size_t probeLen) {
+	pacer->interval = 0;
+	pacer->timerFD = -1;
+	pacer->armedSeqNum = 0;
+	pacer->start = get_time_ns();
+	if (config.ratePps > 0)
+		pacer->interval = 1e9 / config.ratePps;
+	else if (config.rateBps > 0)
+		pacer->interval = 8e9 * probeLen / config.rateBps;
+	else
+		return;
+	pacer->timerFD = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	if (pacer->timerFD < 0)
+		die(EXIT_TIMER_ERROR);
+	prctl(PR_SET_TIMERSLACK, 1UL); // Wake up on time, not up to 50us later
+}
+
+void pacer_stop(Pacer *pacer) {
+	if (pacer->timerFD >= 0)
+		close(pacer->timerFD);
+}
+
+// Returns when probe `seqNum` is due, or `now` if the probes are not paced
+uint64_t pacer_send_time(Pacer *pacer, int seqNum, uint64_t now) {
+	if (pacer->interval == 0)
+		return now;
+	return pacer->start + (uint64_t)((seqNum - 1) * pacer->interval);
+}
+
+// Returns how many probes from `seqNum` on are due at `now`
+int pacer_due_count(Pacer *pacer, int seqNum, uint64_t now) {
+	if (pacer->interval == 0)
+		return INT_MAX;
+	if (now < pacer->start)
+		return 0;
+	long long due = (long long)((now - pacer->start) / pacer->interval) + 1 - (seqNum - 1);
+	return due < 0 ? 0 : due > INT_MAX ? INT_MAX : (int)due;
 }
 
-// Stops timer measurement and returns the elapsed time
-int stop_timer_us() {
-	struct timeval tm2;
-	gettimeofday(&tm2, NULL);
-	return (tm2.tv_sec - tm.tv_sec) * 1e6 + (tm2.tv_usec - tm.tv_usec);
+// Sets the timer to expire when probe `seqNum` is due
+void pacer_wait_for(Pacer *pacer, int seqNum) {
+	if (pacer->armedSeqNum == seqNum)
+		return;
+	struct itimerspec deadline;
+	memset(&deadline, 0, sizeof(deadline));
+	deadline.it_value = from_ns(pacer_send_time(pacer, seqNum, 0));
+	if (timerfd_settime(pacer->timerFD, TFD_TIMER_ABSTIME, &deadline, NULL) < 0)
+		die(EXIT_TIMER_ERROR);
+	pacer->armedSeqNum = seqNum;
+}
+
+// Consumes the timer expiration
+void pacer_clear(Pacer *pacer) {
+	uint64_t expirations;
+	if (read(pacer->timerFD, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+		die(EXIT_TIMER_ERROR);
+}
+
+/* Kernel timestamps */
+
+// Asks for the timestamps of the packets sent and received on the socket.
+// The keys of the transmit timestamps count from now: with TCP, from the
+// next byte sent, as the Hello response acknowledged all the data before.
+void try_enable_timestamping(int socketFD, MeasurementConfig config) {
+	if (config.timestamps == TIMESTAMPS_OFF)
+		return;
+	int flags = SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_RX_SOFTWARE |
+		SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY;
+	// Only reported if the NIC is set to take them (SIOCSHWTSTAMP)
+	if (config.timestamps == TIMESTAMPS_HARDWARE)
+		flags |= SOF_TIMESTAMPING_RAW_HARDWARE | SOF_TIMESTAMPING_TX_HARDWARE | SOF_TIMESTAMPING_RX_HARDWARE;
+	if (setsockopt(socketFD, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) < 0)
+		die(EXIT_TIMESTAMPING_ERROR);
+}
+
+// Stops the timestamps, so that the keys count from the start again when
+// they are enabled for the next measurement
+void try_disable_timestamping(int socketFD, MeasurementConfig config) {
+	int flags = 0;
+	if (config.timestamps != TIMESTAMPS_OFF && setsockopt(socketFD, SOL_SOCKET, SO_TIMESTAMPING, &flags,
+		sizeof(flags)) < 0)
+		die(EXIT_TIMESTAMPING_ERROR);
+}
+
+// Reads the timestamps in the control data of a received message, and the
+// key of a transmit timestamp if `key` is not NULL.
+// Returns false if they are not there.
+bool read_kernel_time(struct msghdr *msg, KernelTime *time, uint32_t *key) {
+	bool hasTime = false, hasKey = false;
+	for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPING) {
+			struct scm_timestamping stamps;
+			memcpy(&stamps, CMSG_DATA(cmsg), sizeof(stamps));
+			time->software = to_ns(stamps.ts[0]);
+			time->hardware = to_ns(stamps.ts[2]);
+			hasTime = true;
+		} else if (cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) {
+			struct sock_extended_err error;
+			memcpy(&error, CMSG_DATA(cmsg), sizeof(error));
+			if (error.ee_errno == ENOMSG && error.ee_origin == SO_EE_ORIGIN_TIMESTAMPING && key != NULL) {
+				*key = error.ee_data;
+				hasKey = true;
+			}
+		}
+	}
+	return hasTime && (key == NULL || hasKey);
+}
+
+void transmit_times_init(TransmitTimes *times, int size) {
+	times->size = size;
+	times->probes = (SentProbe*)try_malloc(size * sizeof(SentProbe));
+	memset(times->probes, 0, size * sizeof(SentProbe));
+	times->nextToRecord = times->nextToStamp = 1;
+}
+
+void transmit_times_free(TransmitTimes *times) {
+	free(times->probes);
+}
+
+// Remembers the key of the timestamp of probe `seqNum`, just sent
+void transmit_times_record(TransmitTimes *times, int seqNum, uint32_t key) {
+	SentProbe *probe = &times->probes[seqNum % times->size];
+	probe->seqNumber = seqNum;
+	probe->key = key;
+	probe->sent.software = probe->sent.hardware = 0;
+	times->nextToRecord = seqNum + 1;
+}
+
+// Gives the timestamp of the send with `key` to its probe. Timestamps come
+// in the order of the sends, but not every send ends a probe (a TCP probe can
+// take several), and a timestamp can be missing.
+void transmit_times_stamp(TransmitTimes *times, uint32_t key, KernelTime time) {
+	while (times->nextToStamp < times->nextToRecord) {
+		SentProbe *probe = &times->probes[times->nextToStamp % times->size];
+		// Software and hardware timestamps of a send come separately
+		if (probe->seqNumber == times->nextToStamp && (int32_t)(probe->key - key) >= 0) {
+			if (probe->key == key && time.software > 0)
+				probe->sent.software = time.software;
+			if (probe->key == key && time.hardware > 0)
+				probe->sent.hardware = time.hardware;
+			return;
+		}
+		times->nextToStamp++; // Its timestamp is missing, or its slot was reused
+	}
+}
+
+// Reads the transmit timestamps queued on the socket
+void receive_transmit_times(int socketFD, TransmitTimes *times) {
+	char control[TIMESTAMP_CONTROL_SIZE];
+	struct msghdr msg;
+	while (true) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		if (recvmsg(socketFD, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return;
+			if (errno != EINTR)
+				die(EXIT_RECV_ERROR);
+			continue;
+		}
+		KernelTime time;
+		uint32_t key;
+		if (read_kernel_time(&msg, &time, &key))
+			transmit_times_stamp(times, key, time);
+	}
+}
+
+// Records the time probe `seqNum` spent in the network stacks and between
+// them: from the timestamp of its last byte leaving to the one of its echo
+// arriving, `received`. Hardware timestamps are used if both are there. The
+// rest of its RTT, `rtt`, is spent in the applications.
+void record_stack_rtt(Stream *stream, TransmitTimes *times, int seqNum, uint64_t rtt, KernelTime received) {
+	SentProbe *probe = &times->probes[seqNum % times->size];
+	uint64_t stackRtt;
+	if (probe->seqNumber != seqNum)
+		return;
+	if (probe->sent.hardware > 0 && received.hardware >= probe->sent.hardware) {
+		stackRtt = received.hardware - probe->sent.hardware;
+		stream->hardwareTimes = true;
+	} else if (probe->sent.software > 0 && received.software >= probe->sent.software) {
+		stackRtt = received.software - probe->sent.software;
+	} else {
+		return;
+	}
+	histogram_record(&stream->stackRtts, stackRtt);
+	histogram_record(&stream->overheads, rtt > stackRtt ? rtt - stackRtt : 0);
+}
+
+// Prints a progress message, away from the results if they are machine-readable
+void log_message(const char *format, ...) {
+	va_list args;
+	va_start(args, format);
+	vfprintf(outputFormat == FORMAT_TEXT ? stdout : stderr, format, args);
+	va_end(args);
+}
+
+/* Trace file: "stream,payload,seq,send_ns,receive_ns,rtt_ns" for every measured probe */
+
+// Writes the probes kept by the stream
+void write_trace(Stream *stream) {
+	pthread_mutex_lock(&traceLock);
+	for (int i = 0; i < stream->traceLength; i++) {
+		TraceRecord *record = &stream->trace[i];
+		fprintf(traceFile, "%d,%d,%d,%llu,%llu,%llu\n", stream->id, stream->config.msgSize, record->seqNumber,
+			(unsigned long long)record->sendTime, (unsigned long long)record->receiveTime,
+			(unsigned long long)(record->receiveTime - record->sendTime));
+	}
+	pthread_mutex_unlock(&traceLock);
+	stream->traceLength = 0;
+}
+
+// Keeps the times of a probe for the trace file; they are written in batches
+void trace_probe(Stream *stream, int seqNum, uint64_t sendTime, uint64_t receiveTime) {
+	if (traceFile == NULL)
+		return;
+	TraceRecord *record = &stream->trace[stream->traceLength++];
+	record->seqNumber = seqNum;
+	record->sendTime = sendTime;
+	record->receiveTime = receiveTime;
+	if (stream->traceLength == TRACE_BUFFER_SIZE)
+		write_trace(stream);
 }
 
 // Generates a cyclic payload like "abc...zabc..."
@@ -173,131 +665,1002 @@ void generate_payload(int size, char* payload) {
 	payload[size] = '\0';
 }
 
-void print_measurement_result(MeasurementConfig config, double value) {
+// Returns the throughput (kbps) of `totalBytes` echoed in `totalTime` nanoseconds
+double get_throughput(long long totalBytes, long long totalTime) {
+	if (totalTime <= 0)
+		return 0; // Nothing echoed
+	return 8.0 * totalBytes / (totalTime / 1e6); // bits / ms = kbps
+}
+
+// Returns the average RTT (ms) or the throughput (kbps) of the probes in
+// `rtts`, echoed in `totalTime` nanoseconds
+double get_measurement_result(MeasurementConfig config, const Histogram *rtts, long long totalBytes,
+	long long totalTime) {
+	if (config.measType == MEAS_RTT_TYPE)
+		return histogram_mean(rtts) / 1e6; // ms
+	return get_throughput(totalBytes, totalTime);
+}
+
+// Prints the percentiles of the times in `values`, in microseconds
+void print_distribution(const char *label, const char *title, const Histogram *values) {
+	printf("%s%s (us): min %.3f p50 %.3f p90 %.3f p99 %.3f p99.9 %.3f max %.3f jitter %.3f\n",
+		label, title, values->min / 1e3, histogram_percentile(values, 50) / 1e3,
+		histogram_percentile(values, 90) / 1e3, histogram_percentile(values, 99) / 1e3,
+		histogram_percentile(values, 99.9) / 1e3, values->max / 1e3, histogram_jitter(values) / 1e3);
+}
+
+void print_measurement_result(MeasurementConfig config, const char *label, const Histogram *rtts, double value) {
 	const char *measType = config.measType == MEAS_RTT_TYPE ? "RTT" : "Throughput";
 	const char *measUnit = config.measType == MEAS_RTT_TYPE ? "ms" : "kbps";
-	printf("%s measured with %d probes with a payload of %d bytes: %.3f%s\n",
-		measType, config.nProbes, config.msgSize, value, measUnit);
+	printf("%s%s measured with %llu probes with a payload of %d bytes: %.3f%s\n",
+		label, measType, (unsigned long long)rtts->count, config.msgSize, value, measUnit);
+	if (rtts->count > 0)
+		print_distribution(label, "RTT distribution", rtts);
 }
 
-// Reads from the socket until it finds a newline
-size_t receive_all_message(int socketFD, char *output) {
-	size_t len = 0, last_read;
-	do {
-		last_read = try_recv(socketFD, output+len);
-		len += last_read;
-	} while(last_read != 0 && output[len-1] != '\n');
-	return len;
+// Prints the RTTs between the kernel timestamps, next to the rest of the RTTs
+void print_stack_results(const char *label, const Histogram *stackRtts, const Histogram *overheads,
+	bool hardwareTimes) {
+	char title[64];
+	if (stackRtts->count == 0) {
+		printf("%sNo kernel timestamps were reported\n", label);
+		return;
+	}
+	sprintf(title, "Stack RTT of %llu probes, %s timestamps", (unsigned long long)stackRtts->count,
+		hardwareTimes ? "hardware" : "software");
+	print_distribution(label, title, stackRtts);
+	print_distribution(label, "Application overhead (RTT - stack RTT)", overheads);
 }
 
-// Creates the hello message checking parameters validity
-void create_hello_message(MeasurementConfig config, char *output) {
-	const char *measurementType = config.measType == MEAS_RTT_TYPE ? MEAS_RTT : MEAS_THPUT;
-	sprintf(output, "h %s %d %d %d\n", measurementType, config.nProbes, config.msgSize, config.serverDelay);
+void print_datagram_stats(const char *label, const DatagramStats *stats) {
+	long long lost = stats->sent - stats->echoed;
+	printf("%sUDP probes: %lld sent, %lld lost (%.3f%%), %lld duplicated, %lld reordered; "
+		"one-way jitter (us): forward %.3f return %.3f\n", label, stats->sent, lost,
+		stats->sent > 0 ? 100.0 * lost / stats->sent : 0, stats->duplicates, stats->reordered,
+		stats->forwardJitter / 1e3, stats->returnJitter / 1e3);
+}
+
+// Returns the name of a configuration value in the JSON results
+const char *get_protocol_name(MeasurementConfig config) {
+	return config.protocol == PROTOCOL_UDP ? UDP_KEYWORD : PROTOCOL_TCP_NAME;
+}
+
+const char *get_timestamps_name(MeasurementConfig config) {
+	if (config.timestamps == TIMESTAMPS_HARDWARE)
+		return TIMESTAMPS_HARDWARE_NAME;
+	return config.timestamps == TIMESTAMPS_SOFTWARE ? TIMESTAMPS_SOFTWARE_NAME : TIMESTAMPS_OFF_NAME;
+}
+
+// Starts the results: the JSON document with the configuration, or the CSV header
+void print_output_start(MeasurementConfig config) {
+	if (outputFormat == FORMAT_JSON) {
+		printf("{\"measurement\": \"%s\", \"protocol\": \"%s\", \"framing\": \"%s\", \"probes\": %d, "
+			"\"warmup\": %d, \"server_delay_ms\": %d, \"window\": %d, \"streams\": %d, \"rate_pps\": %.3f, "
+			"\"rate_bps\": %.3f, \"timestamps\": \"%s\", \"steps\": [",
+			config.measType == MEAS_RTT_TYPE ? MEAS_RTT : MEAS_THPUT, get_protocol_name(config),
+			config.framing == FRAMING_LENGTH ? FRAMING_LENGTH_KEYWORD : FRAMING_NEWLINE_NAME, config.nProbes,
+			config.warmup, config.serverDelay, get_window_size(config), config.streams, config.ratePps,
+			config.rateBps, get_timestamps_name(config));
+	} else if (outputFormat == FORMAT_CSV) {
+		printf("payload,stream,probes,bytes,seconds,throughput_kbps,"
+			"rtt_min_us,rtt_mean_us,rtt_p50_us,rtt_p90_us,rtt_p99_us,rtt_p99.9_us,rtt_max_us,rtt_jitter_us,"
+			"udp_sent,udp_lost,udp_duplicated,udp_reordered,udp_forward_jitter_us,udp_return_jitter_us,"
+			"stack_rtt_p50_us,stack_rtt_p99_us,overhead_p50_us,overhead_p99_us\n");
+	}
+}
+
+void print_output_end() {
+	if (outputFormat == FORMAT_JSON)
+		printf("]}\n");
+}
+
+void print_json_distribution(const char *name, const Histogram *values) {
+	printf(", \"%s\": {\"count\": %llu, \"min\": %.3f, \"mean\": %.3f, \"p50\": %.3f, \"p90\": %.3f, "
+		"\"p99\": %.3f, \"p99.9\": %.3f, \"max\": %.3f, \"jitter\": %.3f}", name,
+		(unsigned long long)values->count, (values->count > 0 ? values->min : 0) / 1e3,
+		histogram_mean(values) / 1e3, histogram_percentile(values, 50) / 1e3,
+		histogram_percentile(values, 90) / 1e3, histogram_percentile(values, 99) / 1e3,
+		histogram_percentile(values, 99.9) / 1e3, values->max / 1e3, histogram_jitter(values) / 1e3);
+}
+
+// Prints the result of a stream (or of all of them) as a JSON object, after
+// a comma unless it is the first of the step
+void print_json_result(MeasurementConfig config, Stream *stream, const char *name, bool first) {
+	long long totalTime = interval_ns(stream->start, stream->end);
+	printf("%s{\"stream\": \"%s\", \"probes\": %llu, \"bytes\": %lld, \"seconds\": %.9f, "
+		"\"throughput_kbps\": %.3f", first ? "" : ", ", name, (unsigned long long)stream->rtts.count,
+		stream->totalBytes, totalTime > 0 ? totalTime / 1e9 : 0, get_throughput(stream->totalBytes, totalTime));
+	print_json_distribution("rtt_us", &stream->rtts);
+	if (config.protocol == PROTOCOL_UDP) {
+		DatagramStats *stats = &stream->datagrams;
+		printf(", \"udp\": {\"sent\": %lld, \"lost\": %lld, \"duplicated\": %lld, \"reordered\": %lld, "
+			"\"forward_jitter_us\": %.3f, \"return_jitter_us\": %.3f}", stats->sent, stats->sent - stats->echoed,
+			stats->duplicates, stats->reordered, stats->forwardJitter / 1e3, stats->returnJitter / 1e3);
+	}
+	if (config.timestamps != TIMESTAMPS_OFF) {
+		printf(", \"stack_timestamps\": \"%s\"", stream->hardwareTimes ? "hardware" : "software");
+		print_json_distribution("stack_rtt_us", &stream->stackRtts);
+		print_json_distribution("overhead_us", &stream->overheads);
+	}
+	printf("}");
+}
+
+// Prints the result of a stream (or of all of them) as a CSV row; the
+// columns which do not apply are empty
+void print_csv_result(MeasurementConfig config, Stream *stream, const char *name) {
+	const Histogram *rtts = &stream->rtts;
+	long long totalTime = interval_ns(stream->start, stream->end);
+	printf("%d,%s,%llu,%lld,%.9f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f", config.msgSize, name,
+		(unsigned long long)rtts->count, stream->totalBytes, totalTime > 0 ? totalTime / 1e9 : 0,
+		get_throughput(stream->totalBytes, totalTime), (rtts->count > 0 ? rtts->min : 0) / 1e3,
+		histogram_mean(rtts) / 1e3, histogram_percentile(rtts, 50) / 1e3, histogram_percentile(rtts, 90) / 1e3,
+		histogram_percentile(rtts, 99) / 1e3, histogram_percentile(rtts, 99.9) / 1e3, rtts->max / 1e3,
+		histogram_jitter(rtts) / 1e3);
+	DatagramStats *stats = &stream->datagrams;
+	if (config.protocol == PROTOCOL_UDP)
+		printf(",%lld,%lld,%lld,%lld,%.3f,%.3f", stats->sent, stats->sent - stats->echoed, stats->duplicates,
+			stats->reordered, stats->forwardJitter / 1e3, stats->returnJitter / 1e3);
+	else
+		printf(",,,,,,");
+	if (config.timestamps != TIMESTAMPS_OFF)
+		printf(",%.3f,%.3f,%.3f,%.3f\n", histogram_percentile(&stream->stackRtts, 50) / 1e3,
+			histogram_percentile(&stream->stackRtts, 99) / 1e3, histogram_percentile(&stream->overheads, 50) / 1e3,
+			histogram_percentile(&stream->overheads, 99) / 1e3);
+	else
+		printf(",,,,\n");
+}
+
+void print_stream_result(MeasurementConfig config, Stream *stream, const char *name, bool first) {
+	if (outputFormat == FORMAT_JSON) {
+		print_json_result(config, stream, name, first);
+	} else if (outputFormat == FORMAT_CSV) {
+		print_csv_result(config, stream, name);
+	} else {
+		double value = get_measurement_result(config, &stream->rtts, stream->totalBytes,
+			interval_ns(stream->start, stream->end));
+		print_measurement_result(config, stream->label, &stream->rtts, value);
+		if (config.protocol == PROTOCOL_UDP)
+			print_datagram_stats(stream->label, &stream->datagrams);
+		if (config.timestamps != TIMESTAMPS_OFF)
+			print_stack_results(stream->label, &stream->stackRtts, &stream->overheads, stream->hardwareTimes);
+	}
+}
+
+// Prints the result of every stream, then the aggregate one: the throughput
+// of all the data echoed from the first start to the last end. The aggregate
+// result goes in `step`.
+void print_results(Stream *streams, MeasurementConfig config, SweepStep *step, bool firstStep) {
+	Stream *all = (Stream*)try_malloc(sizeof(Stream));
+	memset(all, 0, sizeof(Stream));
+	all->start = streams[0].start;
+	all->end = streams[0].end;
+	strcpy(all->label, config.streams > 1 ? "[all] " : "");
+	if (!histogram_init(&all->rtts) || !histogram_init(&all->stackRtts) || !histogram_init(&all->overheads))
+		die(EXIT_MALLOC_ERROR);
+	if (outputFormat == FORMAT_JSON)
+		printf("%s{\"payload\": %d, \"results\": [", firstStep ? "" : ", ", config.msgSize);
+	for (int i = 0; i < config.streams; i++) {
+		Stream *stream = &streams[i];
+		if (config.streams > 1) {
+			char name[16];
+			sprintf(name, "%d", stream->id);
+			print_stream_result(config, stream, name, i == 0);
+		}
+		if (interval_ns(stream->start, all->start) > 0)
+			all->start = stream->start;
+		if (interval_ns(all->end, stream->end) > 0)
+			all->end = stream->end;
+		histogram_merge(&all->rtts, &stream->rtts);
+		histogram_merge(&all->stackRtts, &stream->stackRtts);
+		histogram_merge(&all->overheads, &stream->overheads);
+		all->hardwareTimes = all->hardwareTimes || stream->hardwareTimes;
+		all->totalBytes += stream->totalBytes;
+		all->datagrams.sent += stream->datagrams.sent;
+		all->datagrams.echoed += stream->datagrams.echoed;
+		all->datagrams.duplicates += stream->datagrams.duplicates;
+		all->datagrams.reordered += stream->datagrams.reordered;
+		// The mean of the streams
+		all->datagrams.forwardJitter += stream->datagrams.forwardJitter / config.streams;
+		all->datagrams.returnJitter += stream->datagrams.returnJitter / config.streams;
+	}
+	print_stream_result(config, all, "all", config.streams == 1);
+	if (outputFormat == FORMAT_JSON)
+		printf("]}");
+	step->msgSize = config.msgSize;
+	step->probes = all->rtts.count;
+	step->throughput = get_throughput(all->totalBytes, interval_ns(all->start, all->end));
+	step->p50 = histogram_percentile(&all->rtts, 50);
+	step->p90 = histogram_percentile(&all->rtts, 90);
+	step->p99 = histogram_percentile(&all->rtts, 99);
+	step->p999 = histogram_percentile(&all->rtts, 99.9);
+	step->max = all->rtts.max;
+	histogram_free(&all->rtts);
+	histogram_free(&all->stackRtts);
+	histogram_free(&all->overheads);
+	free(all);
 }
 
-void create_measurement_message(int seqNum, char *payload, char *output) {
-	sprintf(output, "m %d %s\n", seqNum, payload);
+// Reports the first `len` received bytes as the server response and exits
+void die_with_response(Stream *stream, size_t len) {
+	if (len > MAX_BUF_SIZE - 1)
+		len = MAX_BUF_SIZE - 1;
+	frame_buffer_copy(&stream->received, 0, len, stream->buffer);
+	stream->buffer[len] = '\0';
+	lastServerResponse = stream->buffer;
+	die(EXIT_RESPONSE_ERROR);
+}
+
+// Receives more data from the server, never holding more than `maxLength`
+// bytes: a longer message is not the expected one. The server closes the
+// connection after an error response, which is reported.
+// With kernel timestamps, it keeps the one of the last data received.
+void receive_more(Stream *stream, size_t maxLength) {
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	if (stream->config.timestamps != TIMESTAMPS_OFF) {
+		msg.msg_control = stream->control;
+		msg.msg_controllen = sizeof(stream->control);
+	}
+	ssize_t readCount = frame_buffer_receive_msg(&stream->received, stream->socketFD, maxLength, &msg);
+	if (readCount > 0 && stream->config.timestamps != TIMESTAMPS_OFF)
+		read_kernel_time(&msg, &stream->lastReceived, NULL);
+	if (readCount < 0 && errno == ENOMEM)
+		die(EXIT_MALLOC_ERROR);
+	if (readCount < 0 && errno != ENOBUFS)
+		die(EXIT_RECV_ERROR);
+	if (readCount <= 0)
+		die_with_response(stream, stream->received.length);
+}
+
+// Receives a response line and checks that it is the expected one
+void receive_response(Stream *stream, const char *expected) {
+	size_t len;
+	while ((len = frame_buffer_find_line(&stream->received)) == 0)
+		receive_more(stream, MAX_BUF_SIZE);
+	if (len != strlen(expected) || !frame_buffer_equals(&stream->received, 0, expected, len))
+		die_with_response(stream, len);
+	frame_buffer_consume(&stream->received, len);
+}
+
+// Writes the part of probe `seqNum` before the payload; returns its length
+size_t create_probe_header(int seqNum, MeasurementConfig config, char *output) {
+	if (config.framing == FRAMING_LENGTH)
+		return sprintf(output, "m %d %d\n", seqNum, config.msgSize);
+	return sprintf(output, "m %d ", seqNum);
+}
+
+// Returns the part of a probe after the payload
+const char *get_probe_trailer(MeasurementConfig config) {
+	return config.framing == FRAMING_LENGTH ? "" : "\n";
+}
+
+// Checks that the first received message is the echo of probe `seqNum`.
+// Returns its length, 0 if it is not complete yet.
+size_t check_echo(Stream *stream, MeasurementConfig config, int seqNum, const char *payload) {
+	char header[FRAME_HEADER_MAX_SIZE];
+	size_t headerLen = create_probe_header(seqNum, config, header);
+	const char *trailer = get_probe_trailer(config);
+	size_t probeLen = headerLen + config.msgSize + strlen(trailer);
+	size_t len;
+	if (config.framing == FRAMING_NEWLINE) {
+		len = frame_buffer_find_line(&stream->received);
+		if (len == 0 && stream->received.length >= probeLen) // Too long
+			die_with_response(stream, stream->received.length);
+		if (len == 0)
+			return 0;
+	} else {
+		int echoSeqNum;
+		size_t payloadLen;
+		ssize_t echoHeaderLen = frame_buffer_probe_header(&stream->received, &echoSeqNum, &payloadLen);
+		if (echoHeaderLen == 0)
+			return 0;
+		if (echoHeaderLen < 0) { // Not an echo: wait for the whole response
+			len = frame_buffer_find_line(&stream->received);
+			if (len > 0)
+				die_with_response(stream, len);
+			return 0;
+		}
+		len = echoHeaderLen + payloadLen;
+		if (len != probeLen)
+			die_with_response(stream, echoHeaderLen);
+		if (stream->received.length < len)
+			return 0;
+	}
+	if (len != probeLen || !frame_buffer_equals(&stream->received, 0, header, headerLen) ||
+		!frame_buffer_equals(&stream->received, headerLen, payload, config.msgSize) ||
+		!frame_buffer_equals(&stream->received, headerLen + config.msgSize, trailer, strlen(trailer)))
+		die_with_response(stream, len);
+	return len;
+}
+
+// Creates the hello message checking parameters validity. With UDP probes,
+// it tells the port they come from.
+void create_hello_message(MeasurementConfig config, int udpPort, char *output) {
+	const char *measurementType = config.measType == MEAS_RTT_TYPE ? MEAS_RTT : MEAS_THPUT;
+	const char *framing = config.framing == FRAMING_LENGTH ? " " FRAMING_LENGTH_KEYWORD : "";
+	int len = sprintf(output, "h %s %d %d %d%s", measurementType, config.nProbes, config.msgSize, config.serverDelay,
+		framing);
+	if (udpPort > 0)
+		len += sprintf(output + len, " " UDP_KEYWORD " %d", udpPort);
+	strcpy(output + len, "\n");
 }
 
 void create_bye_message(char *output) {
 	strcpy(output, "b\n");
 }
 
-void handle_hello_phase(int socketFD, MeasurementConfig config) {
-	create_hello_message(config, commonBuffer);
-	try_send(socketFD, commonBuffer);
-	printf("Sent Hello message\n");
-	int readCount = receive_all_message(socketFD, commonBuffer);
-	commonBuffer[readCount] = '\0';
-	if (strcmp(commonBuffer, HELLO_OK_RESP) != 0) {
-		lastServerResponse = commonBuffer;
-		die(EXIT_RESPONSE_ERROR);
+// Opens the UDP socket of the stream, on the same address as the TCP one.
+// Returns its port.
+int open_datagram_socket(Stream *stream) {
+	struct sockaddr_in localAddr;
+	socklen_t addrLen = sizeof(localAddr);
+	if (stream->datagramFD >= 0)
+		close(stream->datagramFD); // Of the previous measurement
+	stream->datagramFD = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (stream->datagramFD < 0)
+		die(EXIT_SOCKET_CREATION_ERROR);
+	getsockname(stream->socketFD, (struct sockaddr*)&localAddr, &addrLen);
+	localAddr.sin_port = 0;
+	if (bind(stream->datagramFD, (struct sockaddr*)&localAddr, sizeof(localAddr)) < 0)
+		die(EXIT_CONNECT_ERROR);
+	addrLen = sizeof(localAddr);
+	getsockname(stream->datagramFD, (struct sockaddr*)&localAddr, &addrLen);
+	return ntohs(localAddr.sin_port);
+}
+
+// Receives the response to a Hello message asking for UDP probes, then
+// connects the UDP socket to the server port it tells
+void receive_datagram_response(Stream *stream) {
+	size_t len;
+	while ((len = frame_buffer_find_line(&stream->received)) == 0)
+		receive_more(stream, MAX_BUF_SIZE);
+	char response[MAX_BUF_SIZE];
+	frame_buffer_copy(&stream->received, 0, len, response);
+	response[len] = '\0';
+	char *port = response + strlen(HELLO_UDP_OK_PREFIX);
+	if (strncmp(response, HELLO_UDP_OK_PREFIX, strlen(HELLO_UDP_OK_PREFIX)) != 0 || atoi(port) <= 0 ||
+		atoi(port) > PORT_MAX)
+		die_with_response(stream, len);
+	struct sockaddr_in serverAddr;
+	socklen_t addrLen = sizeof(serverAddr);
+	getpeername(stream->socketFD, (struct sockaddr*)&serverAddr, &addrLen);
+	serverAddr.sin_port = htons(atoi(port));
+	if (connect(stream->datagramFD, (struct sockaddr*)&serverAddr, sizeof(serverAddr)) < 0)
+		die(EXIT_CONNECT_ERROR);
+	frame_buffer_consume(&stream->received, len);
+}
+
+void handle_hello_phase(Stream *stream, MeasurementConfig config) {
+	int udpPort = config.protocol == PROTOCOL_UDP ? open_datagram_socket(stream) : 0;
+	create_hello_message(config, udpPort, stream->buffer);
+	try_send(stream->socketFD, stream->buffer, strlen(stream->buffer));
+	log_message("%sSent Hello message\n", stream->label);
+	if (config.protocol == PROTOCOL_UDP)
+		receive_datagram_response(stream);
+	else
+		receive_response(stream, HELLO_OK_RESP);
+	log_message("%sReceived OK Hello response\n", stream->label);
+}
+
+// Checks if the window has room for the next probe
+bool has_room(MeasurementConfig config, ProbeWindow *window) {
+	return window->nextToSend <= config.nProbes && window->nextToSend - window->nextToReceive < window->size;
+}
+
+// Sends the due probes until the window is full or the socket cannot take more.
+// A probe is sent as its header, the payload and its trailer.
+void send_probes(Stream *stream, MeasurementConfig config, const char *payload, ProbeWindow *window, Pacer *pacer) {
+	const char *trailer = get_probe_trailer(config);
+	while (has_room(config, window)) {
+		if (window->sent == 0) {
+			uint64_t now = get_time_ns();
+			if (pacer_due_count(pacer, window->nextToSend, now) == 0)
+				return;
+			window->headerLen = create_probe_header(window->nextToSend, config, window->header);
+			uint64_t sendTime = pacer_send_time(pacer, window->nextToSend, now);
+			window->sendTimes[window->nextToSend % window->size] = sendTime;
+			if (window->nextToSend == config.warmup + 1)
+				stream->start = from_ns(sendTime);
+		}
+		struct iovec parts[3] = {
+			{window->header, window->headerLen},
+			{(char*)payload, config.msgSize},
+			{(char*)trailer, strlen(trailer)}
+		};
+		size_t probeLen = parts[0].iov_len + parts[1].iov_len + parts[2].iov_len;
+		// Skips what was already sent
+		int first = 0;
+		size_t skip = window->sent;
+		while (skip >= parts[first].iov_len) {
+			skip -= parts[first].iov_len;
+			first++;
+		}
+		parts[first].iov_base = (char*)parts[first].iov_base + skip;
+		parts[first].iov_len -= skip;
+		size_t sentCount = try_send_available(stream->socketFD, parts + first, 3 - first);
+		if (sentCount == 0)
+			return;
+		window->sent += sentCount;
+		window->bytesSent += sentCount;
+		if (window->sent == probeLen) {
+			if (!quiet)
+				log_message("%sSent probe with sequence number %d\n", stream->label, window->nextToSend);
+			transmit_times_record(&window->transmitTimes, window->nextToSend, window->bytesSent - 1);
+			if (window->nextToSend > config.warmup)
+				stream->totalBytes += probeLen;
+			window->nextToSend++;
+			window->sent = 0;
+		}
+	}
+}
+
+// Handles the echoes received for the probes in flight
+void receive_echoes(Stream *stream, MeasurementConfig config, const char *payload, ProbeWindow *window) {
+	size_t len;
+	while (window->nextToReceive < window->nextToSend &&
+		(len = check_echo(stream, config, window->nextToReceive, payload)) > 0) {
+		uint64_t sendTime = window->sendTimes[window->nextToReceive % window->size], now = get_time_ns();
+		long long rtt = now - sendTime;
+		if (window->nextToReceive > config.warmup) {
+			histogram_record(&stream->rtts, rtt);
+			trace_probe(stream, window->nextToReceive, sendTime, now);
+			// The kernel timestamp is the one of the last read: later than the
+			// echo if it came in the same read as a following one
+			record_stack_rtt(stream, &window->transmitTimes, window->nextToReceive, rtt, stream->lastReceived);
+		}
+		frame_buffer_consume(&stream->received, len);
+		if (!quiet)
+			log_message("%sReceived echoed probe %d, RTT was %.3fms%s\n", stream->label, window->nextToReceive,
+				rtt / 1e6, window->nextToReceive > config.warmup ? "" : " (warmup)");
+		window->nextToReceive++;
 	}
-	printf("Received OK Hello response\n");
 }
 
-// Returns the measurement result; -1 if an error occurred
-double handle_measurement_phase(int socketFD, MeasurementConfig config) {
+// Measures the RTTs of the probes, the amount of data echoed and the time
+// taken, leaving out the warmup probes. Up to `window` probes are in flight;
+// when pacing, a probe is sent only once it is due. With kernel timestamps,
+// the transmit ones are read when the socket reports them as errors.
+void handle_measurement_phase(Stream *stream, MeasurementConfig config) {
 	char *payload = allocate_measurement_message(config.msgSize);
-	char *outMessage = allocate_measurement_message(config.msgSize);
-	char *inMessage = allocate_measurement_message(config.msgSize);
 	generate_payload(config.msgSize, payload);
 
-	int totalRtt = 0; // In microseconds
-
-	for(int i = 1; i <= config.nProbes; i++) {
-		create_measurement_message(i, payload, outMessage);
-		start_timer_us();
-		try_send(socketFD, outMessage);
-		printf("Sent probe with sequence number %d\n", i);
-		int readCount = receive_all_message(socketFD, inMessage);
-		int rtt = stop_timer_us();
-		totalRtt += rtt;
-		inMessage[readCount] = '\0';
-		if (strcmp(inMessage, outMessage) != 0) {
-			lastServerResponse = inMessage;
-			die(EXIT_RESPONSE_ERROR);
+	ProbeWindow window;
+	memset(&window, 0, sizeof(window));
+	window.nextToSend = window.nextToReceive = 1;
+	window.size = get_window_size(config);
+	window.sendTimes = (uint64_t*)try_malloc(window.size * sizeof(uint64_t));
+	transmit_times_init(&window.transmitTimes, window.size);
+	try_enable_timestamping(stream->socketFD, config);
+	// Every probe in flight can be echoed before being handled
+	size_t maxReceived = (size_t)window.size * (config.msgSize + FRAME_HEADER_MAX_SIZE);
+	char header[FRAME_HEADER_MAX_SIZE];
+	Pacer pacer;
+	pacer_start(&pacer, config,
+		create_probe_header(config.nProbes, config, header) + config.msgSize + strlen(get_probe_trailer(config)));
+
+	struct pollfd fds[2] = {{stream->socketFD, 0, 0}, {pacer.timerFD, 0, 0}};
+	while (window.nextToReceive <= config.nProbes) {
+		send_probes(stream, config, payload, &window, &pacer);
+		bool canSend = has_room(config, &window);
+		bool waitForPacer = canSend && window.sent == 0 &&
+			pacer_due_count(&pacer, window.nextToSend, get_time_ns()) == 0;
+		if (waitForPacer)
+			pacer_wait_for(&pacer, window.nextToSend);
+		fds[0].events = canSend && !waitForPacer ? POLLIN | POLLOUT : POLLIN;
+		fds[1].events = waitForPacer ? POLLIN : 0;
+		try_poll(fds, 2, -1);
+		if (fds[1].revents & POLLIN)
+			pacer_clear(&pacer);
+		bool timestamped = config.timestamps != TIMESTAMPS_OFF;
+		if ((fds[0].revents & POLLERR) && timestamped)
+			receive_transmit_times(stream->socketFD, &window.transmitTimes);
+		if (fds[0].revents & (POLLIN | POLLHUP) || ((fds[0].revents & POLLERR) && !timestamped)) {
+			receive_more(stream, maxReceived);
+			receive_echoes(stream, config, payload, &window);
 		}
-		printf("Received echoed probe %d, RTT was %.3fms\n", i, rtt/1000.0);
 	}
-	// Assuming the message size is always the same (only changes few bytes in the sequence number)
-	int messageSize = strlen(inMessage);
+	get_time(&stream->end);
+	pacer_stop(&pacer);
+	try_disable_timestamping(stream->socketFD, config);
+	if (config.timestamps != TIMESTAMPS_OFF) // The ones still queued
+		receive_transmit_times(stream->socketFD, &window.transmitTimes);
 	free(payload);
-	free(outMessage);
-	free(inMessage);
-	double avgRtt = (double)totalRtt / config.nProbes / 1000;
-	if (config.measType == MEAS_RTT_TYPE) {
-		return avgRtt; // ms
+	free(window.sendTimes);
+	transmit_times_free(&window.transmitTimes);
+}
+
+DatagramWindow *create_datagram_window(MeasurementConfig config, const char *payload) {
+	DatagramWindow *window = (DatagramWindow*)try_malloc(sizeof(DatagramWindow));
+	memset(window, 0, sizeof(DatagramWindow));
+	window->nextToSend = 1;
+	window->size = get_window_size(config);
+	window->oldestPending = 1;
+	window->sendTimesSize = DATAGRAM_SEND_TIMES_WINDOWS * window->size;
+	window->sendTimes = (uint64_t*)try_malloc(window->sendTimesSize * sizeof(uint64_t));
+	window->echoed = (unsigned char*)try_malloc(config.nProbes / 8 + 1);
+	memset(window->echoed, 0, config.nProbes / 8 + 1);
+	// One more byte for each echo, so that longer ones are noticed
+	size_t slotSize = sizeof(UdpProbeHeader) + config.msgSize + 1;
+	window->buffers = (char*)try_malloc(DATAGRAM_BATCH_SIZE * slotSize);
+	for (int i = 0; i < DATAGRAM_BATCH_SIZE; i++) {
+		window->parts[i][0].iov_base = &window->headers[i];
+		window->parts[i][0].iov_len = sizeof(UdpProbeHeader);
+		window->parts[i][1].iov_base = (char*)payload;
+		window->parts[i][1].iov_len = config.msgSize;
+		window->probes[i].msg_hdr.msg_iov = window->parts[i];
+		window->probes[i].msg_hdr.msg_iovlen = 2;
+		window->buffered[i].iov_base = window->buffers + i * slotSize;
+		window->buffered[i].iov_len = slotSize;
+		window->echoes[i].msg_hdr.msg_iov = &window->buffered[i];
+		window->echoes[i].msg_hdr.msg_iovlen = 1;
+		if (config.timestamps != TIMESTAMPS_OFF)
+			window->echoes[i].msg_hdr.msg_control = window->controls[i];
+	}
+	transmit_times_init(&window->transmitTimes, window->size);
+	return window;
+}
+
+void free_datagram_window(DatagramWindow *window) {
+	free(window->echoed);
+	free(window->sendTimes);
+	free(window->buffers);
+	transmit_times_free(&window->transmitTimes);
+	free(window);
+}
+
+bool is_datagram_echoed(DatagramWindow *window, int seqNum) {
+	return window->echoed[seqNum / 8] & (1 << (seqNum % 8));
+}
+
+// Gives up the probes not echoed within DATAGRAM_LOSS_TIMEOUT_MS, oldest
+// first, so that each one frees its place in the window. A probe is also
+// given up when its send time is needed for a new one: it is lost, or
+// reordered by several windows (a late echo is still counted).
+void expire_datagrams(DatagramWindow *window, uint64_t now) {
+	while (window->oldestPending < window->nextToSend) {
+		int seqNum = window->oldestPending;
+		bool echoed = is_datagram_echoed(window, seqNum);
+		bool expired = now - window->sendTimes[seqNum % window->sendTimesSize] >= DATAGRAM_LOSS_TIMEOUT_MS * 1000000ULL;
+		bool needed = window->nextToSend - seqNum >= window->sendTimesSize;
+		if (!echoed && !expired && !needed)
+			break;
+		if (!echoed)
+			window->inFlight--;
+		window->oldestPending++;
+	}
+}
+
+// Milliseconds until the oldest probe in flight is given up, -1 if there is none
+int get_datagram_expiry_timeout(DatagramWindow *window, uint64_t now) {
+	if (window->oldestPending >= window->nextToSend)
+		return -1;
+	uint64_t expiry = window->sendTimes[window->oldestPending % window->sendTimesSize] +
+		DATAGRAM_LOSS_TIMEOUT_MS * 1000000ULL;
+	return expiry <= now ? 0 : (int)((expiry - now) / 1000000) + 1;
+}
+
+// Number of probes the window has room for
+int get_datagram_room(DatagramWindow *window) {
+	int room = window->size - window->inFlight;
+	int sendTimesRoom = window->sendTimesSize - (window->nextToSend - window->oldestPending);
+	return room < sendTimesRoom ? room : sendTimesRoom;
+}
+
+// Returns how many UDP probes can be sent now: the window has room for
+// them, and they are due
+int get_sendable_datagrams(MeasurementConfig config, DatagramWindow *window, Pacer *pacer, uint64_t now) {
+	int count = get_datagram_room(window);
+	if (count > config.nProbes - window->nextToSend + 1)
+		count = config.nProbes - window->nextToSend + 1;
+	int due = pacer_due_count(pacer, window->nextToSend, now);
+	return count < due ? count : due;
+}
+
+// Sends a batch of UDP probes, as many as can be sent.
+// They share the payload; each one carries the time it is due.
+void send_datagrams(Stream *stream, MeasurementConfig config, DatagramWindow *window, Pacer *pacer) {
+	uint64_t now = get_time_ns();
+	int count = get_sendable_datagrams(config, window, pacer, now);
+	if (count > DATAGRAM_BATCH_SIZE)
+		count = DATAGRAM_BATCH_SIZE;
+	if (count <= 0)
+		return;
+	for (int i = 0; i < count; i++) {
+		window->headers[i].magic = htonl(UDP_PROBE_MAGIC);
+		window->headers[i].seqNumber = htonl(window->nextToSend + i);
+		window->headers[i].sendTime = htobe64(pacer_send_time(pacer, window->nextToSend + i, now));
+		window->headers[i].echoTime = 0;
+	}
+	int sent = sendmmsg(stream->datagramFD, window->probes, count, MSG_DONTWAIT);
+	if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR || errno == ENOBUFS))
+		return;
+	if (sent < 0)
+		die(EXIT_SEND_ERROR);
+	int firstMeasured = config.warmup + 1;
+	if (window->nextToSend <= firstMeasured && firstMeasured < window->nextToSend + sent)
+		stream->start = from_ns(pacer_send_time(pacer, firstMeasured, now));
+	for (int seqNum = window->nextToSend; seqNum < window->nextToSend + sent; seqNum++) {
+		if (seqNum > config.warmup)
+			stream->datagrams.sent++;
+		transmit_times_record(&window->transmitTimes, seqNum, seqNum - 1); // Only probes are sent
+		window->sendTimes[seqNum % window->sendTimesSize] = now;
+	}
+	window->nextToSend += sent;
+	window->inFlight += sent;
+}
+
+// Accounts for the echo of probe `seqNum`, received at `receiveTime` (and at
+// `received` according to the kernel)
+void handle_datagram_echo(Stream *stream, MeasurementConfig config, DatagramWindow *window,
+	const UdpProbeHeader *header, size_t len, uint64_t receiveTime, KernelTime received) {
+	int seqNum = ntohl(header->seqNumber);
+	bool measured = seqNum > config.warmup;
+	if (is_datagram_echoed(window, seqNum)) {
+		if (measured)
+			stream->datagrams.duplicates++;
+		return;
+	}
+	window->echoed[seqNum / 8] |= 1 << (seqNum % 8);
+	if (seqNum >= window->oldestPending)
+		window->inFlight--; // Not if it was already given up
+	if (seqNum < window->highestEchoed) {
+		if (measured)
+			stream->datagrams.reordered++;
 	} else {
-		return 8*messageSize / avgRtt; // bits / ms = kbps
+		window->highestEchoed = seqNum;
+	}
+	if (!measured)
+		return;
+	uint64_t sendTime = be64toh(header->sendTime), echoTime = be64toh(header->echoTime);
+	stream->datagrams.echoed++;
+	stream->totalBytes += len;
+	histogram_record(&stream->rtts, receiveTime - sendTime);
+	trace_probe(stream, seqNum, sendTime, receiveTime);
+	record_stack_rtt(stream, &window->transmitTimes, seqNum, receiveTime - sendTime, received);
+	if (window->hasLast) {
+		// Change of the transit time since the last echo, which does not
+		// depend on the offset between the clocks: J += (|D| - J) / 16
+		double forward = (double)(int64_t)(echoTime - window->lastEcho) - (double)(int64_t)(sendTime - window->lastSend);
+		double back = (double)(int64_t)(receiveTime - window->lastReceive) - (double)(int64_t)(echoTime - window->lastEcho);
+		stream->datagrams.forwardJitter += ((forward < 0 ? -forward : forward) - stream->datagrams.forwardJitter) / 16;
+		stream->datagrams.returnJitter += ((back < 0 ? -back : back) - stream->datagrams.returnJitter) / 16;
 	}
+	window->hasLast = true;
+	window->lastSend = sendTime;
+	window->lastEcho = echoTime;
+	window->lastReceive = receiveTime;
 }
 
-void handle_bye_phase(int socketFD) {
-	create_bye_message(commonBuffer);
-	try_send(socketFD, commonBuffer);
-	printf("Sent Bye message\n");
-	int readCount = receive_all_message(socketFD, commonBuffer);
-	commonBuffer[readCount] = '\0';
-	if (strcmp(commonBuffer, BYE_OK_RESP) != 0) {
-		lastServerResponse = commonBuffer;
-		die(EXIT_RESPONSE_ERROR);
+// Receives a batch of echoes; the ones which are not echoes of the probes are ignored
+void receive_datagrams(Stream *stream, MeasurementConfig config, const char *payload, DatagramWindow *window) {
+	for (int i = 0; i < DATAGRAM_BATCH_SIZE && config.timestamps != TIMESTAMPS_OFF; i++)
+		window->echoes[i].msg_hdr.msg_controllen = TIMESTAMP_CONTROL_SIZE;
+	int count = recvmmsg(stream->datagramFD, window->echoes, DATAGRAM_BATCH_SIZE, MSG_DONTWAIT, NULL);
+	if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+		return;
+	if (count < 0)
+		die(EXIT_RECV_ERROR);
+	struct timespec now;
+	get_time(&now);
+	for (int i = 0; i < count; i++) {
+		const UdpProbeHeader *header = (UdpProbeHeader*)window->buffered[i].iov_base;
+		size_t len = window->echoes[i].msg_len;
+		int seqNum = ntohl(header->seqNumber);
+		if (len != sizeof(UdpProbeHeader) + config.msgSize || ntohl(header->magic) != UDP_PROBE_MAGIC ||
+			seqNum < 1 || seqNum >= window->nextToSend || memcmp(header + 1, payload, config.msgSize) != 0)
+			continue;
+		KernelTime received = {0, 0};
+		if (config.timestamps != TIMESTAMPS_OFF)
+			read_kernel_time(&window->echoes[i].msg_hdr, &received, NULL);
+		handle_datagram_echo(stream, config, window, header, len, to_ns(now), received);
+	}
+	if (count > 0)
+		stream->end = now;
+}
+
+// Measures with UDP probes: up to `window` probes are in flight, and each
+// one not echoed within DATAGRAM_LOSS_TIMEOUT_MS is given up as lost
+void handle_datagram_measurement_phase(Stream *stream, MeasurementConfig config) {
+	char *payload = allocate_measurement_message(config.msgSize);
+	generate_payload(config.msgSize, payload);
+	DatagramWindow *window = create_datagram_window(config, payload);
+	Pacer pacer;
+	pacer_start(&pacer, config, sizeof(UdpProbeHeader) + config.msgSize);
+	try_enable_timestamping(stream->datagramFD, config);
+
+	struct pollfd fds[2] = {{stream->datagramFD, 0, 0}, {pacer.timerFD, 0, 0}};
+	while (window->nextToSend <= config.nProbes || window->inFlight > 0) {
+		bool hasRoom = window->nextToSend <= config.nProbes && get_datagram_room(window) > 0;
+		bool canSend = hasRoom && get_sendable_datagrams(config, window, &pacer, get_time_ns()) > 0;
+		if (hasRoom && !canSend)
+			pacer_wait_for(&pacer, window->nextToSend);
+		fds[0].events = canSend ? POLLIN | POLLOUT : POLLIN;
+		fds[1].events = hasRoom && !canSend ? POLLIN : 0;
+		// The pacer has its own timer: the timeout only gives up probes
+		if (try_poll(fds, 2, get_datagram_expiry_timeout(window, get_time_ns())) > 0) {
+			if (fds[1].revents & POLLIN)
+				pacer_clear(&pacer);
+			if ((fds[0].revents & POLLERR) && config.timestamps != TIMESTAMPS_OFF)
+				receive_transmit_times(stream->datagramFD, &window->transmitTimes);
+			if (fds[0].revents & (POLLIN | POLLERR))
+				receive_datagrams(stream, config, payload, window);
+			if (fds[0].revents & POLLOUT)
+				send_datagrams(stream, config, window, &pacer);
+		}
+		expire_datagrams(window, get_time_ns());
+	}
+	pacer_stop(&pacer);
+	free(payload);
+	free_datagram_window(window);
+}
+
+void handle_bye_phase(Stream *stream) {
+	create_bye_message(stream->buffer);
+	try_send(stream->socketFD, stream->buffer, strlen(stream->buffer));
+	log_message("%sSent Bye message\n", stream->label);
+	receive_response(stream, BYE_OK_RESP);
+	log_message("%sReceived OK Bye response\n", stream->label);
+}
+
+// Carries out a measurement on the connection, started by its Hello message:
+// a sweep sends one for every payload size
+void handle_measurement(Stream *stream, MeasurementConfig config) {
+	handle_hello_phase(stream, config);
+	pthread_barrier_wait(&measurementStart);
+	if (config.protocol == PROTOCOL_UDP)
+		handle_datagram_measurement_phase(stream, config);
+	else
+		handle_measurement_phase(stream, config);
+}
+
+void *run_stream(void *arg) {
+	Stream *stream = (Stream*)arg;
+	handle_measurement(stream, stream->config);
+	return NULL;
+}
+
+// Forgets the results of the previous measurement
+void reset_stream_results(Stream *stream) {
+	histogram_reset(&stream->rtts);
+	histogram_reset(&stream->stackRtts);
+	histogram_reset(&stream->overheads);
+	stream->totalBytes = 0;
+	memset(&stream->datagrams, 0, sizeof(stream->datagrams));
+	stream->hardwareTimes = false;
+}
+
+// Measures on all the streams in parallel, with one thread each
+void run_streams(Stream *streams, MeasurementConfig config) {
+	for (int i = 0; i < config.streams; i++) {
+		streams[i].config = config;
+		reset_stream_results(&streams[i]);
+		if (pthread_create(&streams[i].thread, NULL, run_stream, &streams[i]) != 0)
+			die(EXIT_THREAD_ERROR);
 	}
-	printf("Received OK Bye response\n");
+	for (int i = 0; i < config.streams; i++) {
+		pthread_join(streams[i].thread, NULL);
+		if (traceFile != NULL)
+			write_trace(&streams[i]);
+	}
+}
+
+// Returns the payload size measured after `msgSize`, 0 if it was the last one
+int get_next_size(MeasurementConfig config, int msgSize) {
+	if (config.sweepMax == 0)
+		return 0;
+	double next = (long long)(msgSize * config.sweepFactor + 0.5);
+	if (next < msgSize + 1)
+		next = msgSize + 1;
+	return next > config.sweepMax ? 0 : (int)next;
 }
 
-// Handles a measuremente session with the server
-void handle_session(int socketFD, MeasurementConfig config) {
-	handle_hello_phase(socketFD, config);
-	double result = handle_measurement_phase(socketFD, config);
-	handle_bye_phase(socketFD);
-	print_measurement_result(config, result);
+// Prints a line for every payload size of a sweep, to see where the
+// throughput stops growing and the RTTs start to
+void print_sweep_summary(SweepStep *steps, int count) {
+	printf("Sweep summary:\n%10s %8s %16s %10s %10s %10s %10s %10s\n", "payload", "probes", "kbps",
+		"p50 us", "p90 us", "p99 us", "p99.9 us", "max us");
+	for (int i = 0; i < count; i++) {
+		printf("%10d %8llu %16.3f %10.3f %10.3f %10.3f %10.3f %10.3f\n", steps[i].msgSize, steps[i].probes,
+			steps[i].throughput, steps[i].p50 / 1e3, steps[i].p90 / 1e3, steps[i].p99 / 1e3, steps[i].p999 / 1e3,
+			steps[i].max / 1e3);
+	}
 }
 
-// Carry out a complete measurement
+// Carry out a complete measurement, with a session on every stream. A sweep
+// measures every payload size in turn on the same connections.
 void measure(const char* serverAddr, const int port, MeasurementConfig config) {
-	// Connects to the server
-	int serverSocket = try_create_tcp_socket();
-	try_connect(serverSocket, serverAddr, port);
-	handle_session(serverSocket, config);
+	Stream *streams = (Stream*)try_malloc(config.streams * sizeof(Stream));
+	if (pthread_barrier_init(&measurementStart, NULL, config.streams) != 0)
+		die(EXIT_THREAD_ERROR);
+	for (int i = 0; i < config.streams; i++) {
+		Stream *stream = &streams[i];
+		memset(stream, 0, sizeof(Stream));
+		stream->id = i;
+		stream->config = config;
+		stream->datagramFD = -1;
+		if (traceFile != NULL)
+			stream->trace = (TraceRecord*)try_malloc(TRACE_BUFFER_SIZE * sizeof(TraceRecord));
+		if (config.streams > 1)
+			sprintf(stream->label, "[%d] ", i);
+		// Connects to the server
+		stream->socketFD = try_create_tcp_socket();
+		try_connect(stream->socketFD, serverAddr, port);
+		try_disable_nagle(stream->socketFD);
+		if (!frame_buffer_init(&stream->received) || !histogram_init(&stream->rtts) ||
+			!histogram_init(&stream->stackRtts) || !histogram_init(&stream->overheads))
+			die(EXIT_MALLOC_ERROR);
+	}
+	int stepCount = 0;
+	for (int size = config.msgSize; size > 0; size = get_next_size(config, size))
+		stepCount++;
+	SweepStep *steps = (SweepStep*)try_malloc(stepCount * sizeof(SweepStep));
+	int step = 0;
+	print_output_start(config);
+	for (int size = config.msgSize; size > 0; size = get_next_size(config, size), step++) {
+		config.msgSize = size;
+		run_streams(streams, config);
+		print_results(streams, config, &steps[step], step == 0);
+	}
+	for (int i = 0; i < config.streams; i++)
+		handle_bye_phase(&streams[i]);
+	print_output_end();
+	if (config.sweepMax > 0 && outputFormat == FORMAT_TEXT)
+		print_sweep_summary(steps, stepCount);
+	free(steps);
+}
+
+// Reads a non-negative integer option value; returns false if it is not valid
+bool read_int_option(const char *value, int *result) {
+	if (strlen(value) > MAX_INT_LENGTH)
+		return false;
+	for (const char *c = value; *c != '\0'; c++) {
+		if (!isdigit(*c))
+			return false;
+	}
+	*result = atoi(value);
+	return *value != '\0';
+}
+
+// Reads a size in bytes, like "512", "64k" or "16M" (binary prefixes);
+// returns false if it is not valid
+bool read_size_option(const char *value, int *result) {
+	char *unit;
+	long long size = strtoll(value, &unit, 10);
+	if (unit == value || !isdigit(*value))
+		return false;
+	if (*unit == 'k' || *unit == 'K' || *unit == 'M') {
+		size <<= *unit == 'M' ? 20 : 10;
+		unit++;
+	}
+	*result = (int)size;
+	return *unit == '\0' && size > 0 && size <= MAX_INT_VALUE;
+}
+
+// Reads the options of a sweep: "<first size> <last size> x<factor>".
+// Returns false if they are not valid.
+bool read_sweep_option(const char *first, const char *last, const char *factor, MeasurementConfig *config) {
+	char *end;
+	if (last == NULL || factor == NULL || !read_size_option(first, &config->sweepMin) ||
+		!read_size_option(last, &config->sweepMax) || config->sweepMin > config->sweepMax ||
+		factor[0] != SWEEP_FACTOR_PREFIX)
+		return false;
+	config->sweepFactor = strtod(factor + 1, &end);
+	return end != factor + 1 && *end == '\0' && config->sweepFactor > 1;
+}
+
+// Reads a rate in probes/s or bits/s, like "500pps" or "10Mbps" (k, M and
+// G prefixes); returns false if it is not valid
+bool read_rate_option(const char *value, MeasurementConfig *config) {
+	char *unit;
+	double rate = strtod(value, &unit);
+	if (unit == value || !(rate > 0))
+		return false;
+	if (*unit == 'k' || *unit == 'M' || *unit == 'G') {
+		rate *= *unit == 'k' ? 1e3 : *unit == 'M' ? 1e6 : 1e9;
+		unit++;
+	}
+	config->ratePps = config->rateBps = 0;
+	if (strcmp(unit, RATE_PPS_UNIT) == 0)
+		config->ratePps = rate;
+	else if (strcmp(unit, RATE_BPS_UNIT) == 0)
+		config->rateBps = rate;
+	else
+		return false;
+	return true;
+}
+
+// Reads the options after the measurement parameters: "name value" pairs.
+// Returns false if an option is not valid.
+bool read_options(char *options, MeasurementConfig *config) {
+	char *name, *value, *position;
+	while ((name = strtok_r(options, " \t\n", &position)) != NULL) {
+		options = NULL;
+		value = strtok_r(NULL, " \t\n", &position);
+		if (value == NULL)
+			return false;
+		if (strcmp(name, OPTION_WINDOW) == 0) {
+			if (!read_int_option(value, &config->window) || config->window == 0)
+				return false;
+		} else if (strcmp(name, OPTION_STREAMS) == 0) {
+			if (!read_int_option(value, &config->streams) || config->streams == 0 || config->streams > MAX_STREAMS)
+				return false;
+		} else if (strcmp(name, OPTION_WARMUP) == 0) {
+			if (!read_int_option(value, &config->warmup))
+				return false;
+		} else if (strcmp(name, OPTION_SWEEP) == 0) {
+			const char *last = strtok_r(NULL, " \t\n", &position);
+			const char *factor = strtok_r(NULL, " \t\n", &position);
+			if (!read_sweep_option(value, last, factor, config))
+				return false;
+		} else if (strcmp(name, OPTION_TIMESTAMPS) == 0) {
+			if (strcmp(value, TIMESTAMPS_OFF_NAME) == 0)
+				config->timestamps = TIMESTAMPS_OFF;
+			else if (strcmp(value, TIMESTAMPS_SOFTWARE_NAME) == 0)
+				config->timestamps = TIMESTAMPS_SOFTWARE;
+			else if (strcmp(value, TIMESTAMPS_HARDWARE_NAME) == 0)
+				config->timestamps = TIMESTAMPS_HARDWARE;
+			else
+				return false;
+		} else if (strcmp(name, OPTION_RATE) == 0) {
+			if (!read_rate_option(value, config))
+				return false;
+		} else if (strcmp(name, OPTION_PROTOCOL) == 0) {
+			if (strcmp(value, PROTOCOL_TCP_NAME) == 0)
+				config->protocol = PROTOCOL_TCP;
+			else if (strcmp(value, UDP_KEYWORD) == 0)
+				config->protocol = PROTOCOL_UDP;
+			else
+				return false;
+		} else if (strcmp(name, OPTION_FRAMING) == 0) {
+			if (strcmp(value, FRAMING_NEWLINE_NAME) == 0)
+				config->framing = FRAMING_NEWLINE;
+			else if (strcmp(value, FRAMING_LENGTH_KEYWORD) == 0)
+				config->framing = FRAMING_LENGTH;
+			else
+				return false;
+		} else {
+			return false;
+		}
+	}
+	return true;
 }
 
 // Reads configuration parameters
 MeasurementConfig read_config() {
 	MeasurementConfig config;
 	char measType[20];
-	fgets(commonBuffer, MAX_BUF_SIZE, stdin); // Only read one line
-	int readCount = sscanf(commonBuffer, "%s %d %d %d", measType, &config.nProbes, &config.msgSize, &config.serverDelay);
+	int optionsStart = 0, optionsStartWithDelay = 0;
+	config.framing = FRAMING_NEWLINE;
+	config.window = 0;
+	config.streams = 1;
+	config.warmup = 0;
+	config.protocol = PROTOCOL_TCP;
+	config.ratePps = config.rateBps = 0;
+	config.timestamps = TIMESTAMPS_OFF;
+	config.sweepMin = config.sweepMax = 0;
+	if (fgets(commonBuffer, MAX_BUF_SIZE, stdin) == NULL) // Only read one line
+		die(EXIT_PARAMETERS_ERROR);
+	int readCount = sscanf(commonBuffer, "%19s %d %d%n %d%n", measType, &config.nProbes, &config.msgSize,
+		&optionsStart, &config.serverDelay, &optionsStartWithDelay);
 	if (readCount < 3 || (strcmp(measType, MEAS_THPUT) != 0 && strcmp(measType, MEAS_RTT) != 0)) {
 		die(EXIT_PARAMETERS_ERROR);
 	}
 	if (readCount == 3) { // Server delay is optional, default is 0
 		config.serverDelay = 0;
+	} else {
+		optionsStart = optionsStartWithDelay;
+	}
+	if (!read_options(commonBuffer + optionsStart, &config)) {
+		die(EXIT_PARAMETERS_ERROR);
 	}
+	// A sweep replaces the payload size: it is valid if the largest one is
+	if (config.sweepMax > 0)
+		config.msgSize = config.sweepMax;
 	if (!check_parameters(config)) {
 		die(EXIT_PARAMETERS_ERROR);
 	}
+	if (config.sweepMax > 0)
+		config.msgSize = config.sweepMin;
 	if (strcmp(measType, MEAS_THPUT) == 0) {
 		config.measType = MEAS_THPUT_TYPE;
 	} else {
@@ -306,13 +1669,58 @@ MeasurementConfig read_config() {
 	return config;
 }
 
+// Opens the trace file, with its header
+void open_trace(const char *path) {
+	traceFile = fopen(path, "w");
+	if (traceFile == NULL)
+		die(EXIT_TRACE_ERROR);
+	setvbuf(traceFile, NULL, _IOFBF, 1 << 20);
+	fprintf(traceFile, "stream,payload,seq,send_ns,receive_ns,rtt_ns\n");
+}
+
+void close_trace() {
+	bool failed = ferror(traceFile);
+	if (fclose(traceFile) != 0 || failed)
+		die(EXIT_TRACE_ERROR);
+}
+
+// Reads the options before the address: "--format text|json|csv",
+// "--trace FILE" and "--quiet". Returns the index of the address.
+int read_command_options(int argc, char **argv) {
+	int i = 1;
+	while (i < argc && strncmp(argv[i], "--", 2) == 0) {
+		if (strcmp(argv[i], QUIET_OPTION) == 0) {
+			quiet = true;
+			i++;
+			continue;
+		}
+		if (i + 1 >= argc)
+			die(EXIT_INVALID_PORT);
+		if (strcmp(argv[i], FORMAT_OPTION) == 0 && strcmp(argv[i + 1], FORMAT_TEXT_NAME) == 0)
+			outputFormat = FORMAT_TEXT;
+		else if (strcmp(argv[i], FORMAT_OPTION) == 0 && strcmp(argv[i + 1], FORMAT_JSON_NAME) == 0)
+			outputFormat = FORMAT_JSON;
+		else if (strcmp(argv[i], FORMAT_OPTION) == 0 && strcmp(argv[i + 1], FORMAT_CSV_NAME) == 0)
+			outputFormat = FORMAT_CSV;
+		else if (strcmp(argv[i], TRACE_OPTION) == 0 && traceFile == NULL)
+			open_trace(argv[i + 1]);
+		else
+			die(EXIT_INVALID_PORT);
+		i += 2;
+	}
+	return i;
+}
+
 int main(int argc, char **argv) {
-	// Read and check port parameter
-	if (argc != 3 || !is_valid_port(argv[2])) {
+	// Read and check the options and the port parameter
+	int first = read_command_options(argc, argv);
+	if (argc - first != 2 || !is_valid_port(argv[first + 1])) {
 		die(EXIT_INVALID_PORT);
 	}
-	int port = atoi(argv[2]);
+	int port = atoi(argv[first + 1]);
 
 	MeasurementConfig config = read_config();
-	measure(argv[1], port, config);
+	measure(argv[first], port, config);
+	if (traceFile != NULL)
+		close_trace();
 }
@@ -0,0 +1,238 @@
+#ifndef FRAMING_H
+#define FRAMING_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+// Streaming reader for the messages of the measurement protocol, shared by
+// the client and the server.
+//
+// Received bytes are kept in a growable ring buffer: every read uses all the
+// free room, and consuming a message never moves the ones received after it,
+// so messages can arrive coalesced in one segment or split across many.
+//
+// Messages are newline-terminated lines. When length framing is negotiated
+// (the Hello message ends with " len"), every probe is instead a header line
+// "m <seq> <len>\n" followed by exactly <len> payload bytes: the payload is
+// never scanned, and the echo is the same frame.
+//
+// When UDP is negotiated instead (the Hello message ends with " udp <port>",
+// the client UDP port), the Hello and Bye messages still go over TCP, but
+// every probe is a single datagram: a UdpProbeHeader followed by the payload.
+
+#define FRAMING_NEWLINE 0
+#define FRAMING_LENGTH 1
+#define FRAMING_LENGTH_KEYWORD "len"
+#define FRAME_MIN_CAPACITY 4096
+#define FRAME_MAX_INT_LENGTH 8
+#define FRAME_HEADER_MAX_SIZE 32 // Longest "m <seq> <len>\n"
+#define UDP_KEYWORD "udp"
+#define UDP_PROBE_MAGIC 0x6d656173 // "meas"
+#define UDP_MAX_DATAGRAM 65507
+
+// Header of the UDP probes, in network byte order. The server echoes a probe
+// after writing the time it received it: the client can then measure the
+// jitter of each direction, since the offset between the clocks cancels out.
+typedef struct {
+	uint32_t magic;     // UDP_PROBE_MAGIC
+	uint32_t seqNumber;
+	uint64_t sendTime;  // Nanoseconds, client clock
+	uint64_t echoTime;  // Nanoseconds, server clock
+} UdpProbeHeader;
+
+typedef struct {
+	char *data;
+	size_t capacity;
+	size_t start;   // Offset of the first unread byte
+	size_t length;  // Number of unread bytes
+	size_t scanned; // Unread bytes already searched for a newline
+} FrameBuffer;
+
+// Returns false if the memory cannot be allocated
+bool frame_buffer_init(FrameBuffer *buffer) {
+	buffer->data = (char*)malloc(FRAME_MIN_CAPACITY);
+	buffer->capacity = FRAME_MIN_CAPACITY;
+	buffer->start = buffer->length = buffer->scanned = 0;
+	return buffer->data != NULL;
+}
+
+void frame_buffer_free(FrameBuffer *buffer) {
+	free(buffer->data);
+	buffer->data = NULL;
+}
+
+// Describes the `len` bytes starting `offset` bytes after the first unread
+// one (also free room, if they go past the unread bytes). They are split in
+// two when they wrap around the end of the buffer.
+// Returns the number of regions used.
+int frame_buffer_regions(FrameBuffer *buffer, size_t offset, size_t len, struct iovec regions[2]) {
+	if (len == 0)
+		return 0;
+	size_t first = buffer->start + offset;
+	if (first >= buffer->capacity)
+		first -= buffer->capacity;
+	regions[0].iov_base = buffer->data + first;
+	if (len <= buffer->capacity - first) {
+		regions[0].iov_len = len;
+		return 1;
+	}
+	regions[0].iov_len = buffer->capacity - first;
+	regions[1].iov_base = buffer->data;
+	regions[1].iov_len = len - regions[0].iov_len;
+	return 2;
+}
+
+// Copies `len` unread bytes, starting `offset` bytes after the first one
+void frame_buffer_copy(FrameBuffer *buffer, size_t offset, size_t len, char *output) {
+	struct iovec regions[2];
+	int count = frame_buffer_regions(buffer, offset, len, regions);
+	for (int i = 0; i < count; i++) {
+		memcpy(output, regions[i].iov_base, regions[i].iov_len);
+		output += regions[i].iov_len;
+	}
+}
+
+// Checks if `len` unread bytes, starting `offset` bytes after the first one,
+// are the same as `data`
+bool frame_buffer_equals(FrameBuffer *buffer, size_t offset, const char *data, size_t len) {
+	struct iovec regions[2];
+	int count = frame_buffer_regions(buffer, offset, len, regions);
+	for (int i = 0; i < count; i++) {
+		if (memcmp(data, regions[i].iov_base, regions[i].iov_len) != 0)
+			return false;
+		data += regions[i].iov_len;
+	}
+	return true;
+}
+
+// Makes room for at least `size` unread bytes.
+// Returns false if the memory cannot be allocated.
+bool frame_buffer_reserve(FrameBuffer *buffer, size_t size) {
+	if (size <= buffer->capacity)
+		return true;
+	char *data = (char*)malloc(size);
+	if (data == NULL)
+		return false;
+	frame_buffer_copy(buffer, 0, buffer->length, data);
+	free(buffer->data);
+	buffer->data = data;
+	buffer->capacity = size;
+	buffer->start = 0;
+	return true;
+}
+
+// Adds `len` bytes in front of the unread ones: the caller fills them
+// through frame_buffer_regions. Returns false if the memory cannot be allocated.
+bool frame_buffer_prepend(FrameBuffer *buffer, size_t len) {
+	if (!frame_buffer_reserve(buffer, buffer->length + len))
+		return false;
+	if (buffer->start >= len)
+		buffer->start -= len;
+	else
+		buffer->start += buffer->capacity - len;
+	buffer->length += len;
+	buffer->scanned = 0;
+	return true;
+}
+
+// Removes the first `len` unread bytes
+void frame_buffer_consume(FrameBuffer *buffer, size_t len) {
+	buffer->start += len;
+	if (buffer->start >= buffer->capacity)
+		buffer->start -= buffer->capacity;
+	buffer->length -= len;
+	buffer->scanned = buffer->scanned > len ? buffer->scanned - len : 0;
+	if (buffer->length == 0)
+		buffer->start = 0; // The next message is less likely to wrap
+}
+
+// Receives into all the free room, growing the buffer (doubling it) when it
+// is full, but never holding more than `maxLength` unread bytes. The control
+// data (like timestamps) goes where `msg` tells, if it asks for any.
+// Returns the result of recvmsg: -1 with errno ENOBUFS if the buffer already
+// holds `maxLength` bytes, with errno ENOMEM if it cannot grow.
+ssize_t frame_buffer_receive_msg(FrameBuffer *buffer, int socketFD, size_t maxLength, struct msghdr *msg) {
+	if (buffer->length >= maxLength) {
+		errno = ENOBUFS;
+		return -1;
+	}
+	if (buffer->length == buffer->capacity) {
+		size_t capacity = buffer->capacity * 2 < maxLength ? buffer->capacity * 2 : maxLength;
+		if (!frame_buffer_reserve(buffer, capacity)) {
+			errno = ENOMEM;
+			return -1;
+		}
+	}
+	size_t room = buffer->capacity - buffer->length;
+	if (room > maxLength - buffer->length)
+		room = maxLength - buffer->length;
+	struct iovec regions[2];
+	msg->msg_iov = regions;
+	msg->msg_iovlen = frame_buffer_regions(buffer, buffer->length, room, regions);
+	ssize_t readCount = recvmsg(socketFD, msg, 0);
+	if (readCount > 0)
+		buffer->length += readCount;
+	return readCount;
+}
+
+ssize_t frame_buffer_receive(FrameBuffer *buffer, int socketFD, size_t maxLength) {
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	return frame_buffer_receive_msg(buffer, socketFD, maxLength, &msg);
+}
+
+// Returns the length of the first line, newline included, or 0 if it is not
+// complete yet. The bytes already searched are not searched again.
+size_t frame_buffer_find_line(FrameBuffer *buffer) {
+	struct iovec regions[2];
+	int count = frame_buffer_regions(buffer, buffer->scanned, buffer->length - buffer->scanned, regions);
+	size_t offset = buffer->scanned;
+	for (int i = 0; i < count; i++) {
+		char *newline = (char*)memchr(regions[i].iov_base, '\n', regions[i].iov_len);
+		if (newline != NULL) {
+			buffer->scanned = offset + (newline - (char*)regions[i].iov_base);
+			return buffer->scanned + 1;
+		}
+		offset += regions[i].iov_len;
+	}
+	buffer->scanned = buffer->length;
+	return 0;
+}
+
+// Reads a decimal field of at most FRAME_MAX_INT_LENGTH digits ending with
+// `delim`. Returns the character after the delimiter, NULL if not valid.
+const char *read_frame_int(const char *s, char delim, size_t *value) {
+	const char *c = s;
+	*value = 0;
+	while (isdigit(*c) && c - s < FRAME_MAX_INT_LENGTH)
+		*value = *value * 10 + (*c++ - '0');
+	return c > s && *c == delim ? c + 1 : NULL;
+}
+
+// Parses the probe header "m <seq> <len>\n" used with length framing.
+// Returns the length of the header, 0 if it is not complete yet, -1 if it is
+// not valid.
+ssize_t frame_buffer_probe_header(FrameBuffer *buffer, int *seqNumber, size_t *payloadLen) {
+	char header[FRAME_HEADER_MAX_SIZE + 1];
+	size_t len = buffer->length < FRAME_HEADER_MAX_SIZE ? buffer->length : FRAME_HEADER_MAX_SIZE;
+	frame_buffer_copy(buffer, 0, len, header);
+	header[len] = '\0';
+	char *newline = (char*)memchr(header, '\n', len);
+	if (newline == NULL)
+		return len < FRAME_HEADER_MAX_SIZE && (len < 1 || header[0] == 'm') ? 0 : -1;
+	size_t seq;
+	const char *next = header[0] == 'm' && header[1] == ' ' ? read_frame_int(header + 2, ' ', &seq) : NULL;
+	if (next == NULL || read_frame_int(next, '\n', payloadLen) != newline + 1)
+		return -1;
+	*seqNumber = (int)seq;
+	return newline + 1 - header;
+}
+
+#endif
@@ -0,0 +1,130 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Log-bucketed histogram of 64-bit values (like HdrHistogram), used for the
+// RTTs in nanoseconds.
+//
+// Values below 2^HISTOGRAM_PRECISION_BITS have a bucket each. Every larger
+// power of two is split into 2^(HISTOGRAM_PRECISION_BITS - 1) buckets of the
+// same width, so a value is known within 1/128 of itself, whatever its
+// magnitude, with a fixed amount of memory. Minimum, maximum and mean are exact.
+
+#define HISTOGRAM_PRECISION_BITS 8
+#define HISTOGRAM_HALF_BUCKETS (1 << (HISTOGRAM_PRECISION_BITS - 1))
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_PRECISION_BITS + 2) * HISTOGRAM_HALF_BUCKETS)
+
+typedef struct {
+	uint64_t *counts;
+	uint64_t count;
+	uint64_t min;
+	uint64_t max;
+	uint64_t sum;
+	// Jitter: mean difference between consecutive values, in recording order
+	uint64_t jitterSum;
+	uint64_t jitterCount;
+	uint64_t last;
+} Histogram;
+
+// Returns false if the memory cannot be allocated
+bool histogram_init(Histogram *histogram) {
+	histogram->counts = (uint64_t*)calloc(HISTOGRAM_BUCKETS, sizeof(uint64_t));
+	histogram->count = histogram->max = histogram->sum = 0;
+	histogram->jitterSum = histogram->jitterCount = histogram->last = 0;
+	histogram->min = UINT64_MAX;
+	return histogram->counts != NULL;
+}
+
+void histogram_free(Histogram *histogram) {
+	free(histogram->counts);
+	histogram->counts = NULL;
+}
+
+// Forgets the recorded values
+void histogram_reset(Histogram *histogram) {
+	memset(histogram->counts, 0, HISTOGRAM_BUCKETS * sizeof(uint64_t));
+	histogram->count = histogram->max = histogram->sum = 0;
+	histogram->jitterSum = histogram->jitterCount = histogram->last = 0;
+	histogram->min = UINT64_MAX;
+}
+
+// Number of low bits dropped from the values in the bucket of `value`
+int histogram_shift(uint64_t value) {
+	int magnitude = value == 0 ? 0 : 63 - __builtin_clzll(value);
+	return magnitude < HISTOGRAM_PRECISION_BITS ? 0 : magnitude - HISTOGRAM_PRECISION_BITS + 1;
+}
+
+int histogram_bucket(uint64_t value) {
+	int shift = histogram_shift(value);
+	return shift * HISTOGRAM_HALF_BUCKETS + (int)(value >> shift);
+}
+
+// Returns the middle of the values in `bucket`
+uint64_t histogram_bucket_value(int bucket) {
+	int shift = bucket < 2 * HISTOGRAM_HALF_BUCKETS ? 0 : bucket / HISTOGRAM_HALF_BUCKETS - 1;
+	uint64_t low = (uint64_t)(bucket - shift * HISTOGRAM_HALF_BUCKETS) << shift;
+	return low + ((1ULL << shift) - 1) / 2;
+}
+
+void histogram_record(Histogram *histogram, uint64_t value) {
+	histogram->counts[histogram_bucket(value)]++;
+	if (histogram->count > 0) {
+		histogram->jitterSum += value > histogram->last ? value - histogram->last : histogram->last - value;
+		histogram->jitterCount++;
+	}
+	histogram->last = value;
+	histogram->count++;
+	histogram->sum += value;
+	if (value < histogram->min)
+		histogram->min = value;
+	if (value > histogram->max)
+		histogram->max = value;
+}
+
+// Adds the values recorded in `other`
+void histogram_merge(Histogram *histogram, const Histogram *other) {
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+		histogram->counts[i] += other->counts[i];
+	histogram->count += other->count;
+	histogram->sum += other->sum;
+	histogram->jitterSum += other->jitterSum;
+	histogram->jitterCount += other->jitterCount;
+	if (other->min < histogram->min)
+		histogram->min = other->min;
+	if (other->max > histogram->max)
+		histogram->max = other->max;
+}
+
+// Returns the smallest value not exceeded by `percentile`% of the values,
+// within the precision of the histogram (0 if it is empty)
+uint64_t histogram_percentile(const Histogram *histogram, double percentile) {
+	if (histogram->count == 0)
+		return 0;
+	uint64_t rank = (uint64_t)(percentile / 100 * histogram->count + 0.5);
+	if (rank < 1)
+		rank = 1;
+	uint64_t seen = 0;
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		seen += histogram->counts[i];
+		if (seen >= rank) {
+			uint64_t value = histogram_bucket_value(i);
+			// The exact extremes are known
+			return value < histogram->min ? histogram->min : value > histogram->max ? histogram->max : value;
+		}
+	}
+	return histogram->max;
+}
+
+double histogram_mean(const Histogram *histogram) {
+	return histogram->count == 0 ? 0 : (double)histogram->sum / histogram->count;
+}
+
+double histogram_jitter(const Histogram *histogram) {
+	return histogram->jitterCount == 0 ? 0 : (double)histogram->jitterSum / histogram->jitterCount;
+}
+
+#endif
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // accept4
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -5,11 +6,20 @@
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include<unistd.h>
 #include <stdbool.h>
 #include <time.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "framing.h"
 
 #define MAX_BUF_SIZE 1024
 #define PORT_MAX 65535
@@ -19,9 +29,18 @@
 #define MEAS_RTT_TYPE 1
 #define MAX_INT_VALUE 1e8
 #define MAX_INT_LENGTH 8
-#define MAX_TCP_PENDING_CONNECTIONS 8
+#define MAX_TCP_PENDING_CONNECTIONS 4096
+#define MAX_EVENTS 64
+#define MAX_THREADS 256
+#define THREADS_OPTION "--threads"
+#define QUIET_OPTION "--quiet"
+#define SPLICE_MIN_PAYLOAD (64 * 1024) // Smaller probes are echoed from the input buffer
+#define READ_AHEAD_SIZE (64 * 1024) // Pipelined probes read with the current one
+#define DATAGRAM_BATCH_SIZE 64 // UDP probes received and echoed with one system call
+#define DATAGRAM_BATCHES_PER_WAKEUP 4 // Then the other sessions of the reactor get their turn
 
 #define HELLO_OK_RESP "200 OK - Ready\n"
+#define HELLO_UDP_OK_RESP "200 OK - Ready %d\n" // With the server UDP port
 #define HELLO_ERROR_RESP "404 ERROR - Invalid Hello message\n"
 #define MEASUREMENT_ERROR_RESP "404 ERROR - Invalid Measurement message\n"
 #define BYE_OK_RESP "200 OK - Closing\n"
@@ -35,19 +54,107 @@
 #define EXIT_INVALID_PORT 23
 #define EXIT_RECV_ERROR 24
 #define EXIT_MALLOC_ERROR 25
+#define EXIT_EPOLL_ERROR 26
+#define EXIT_TIMER_ERROR 27
+#define EXIT_SOCKET_OPTION_ERROR 28
+#define EXIT_THREAD_ERROR 29
+#define EXIT_PIPE_ERROR 30
 
 #define EXIT_SEND_ERROR_MSG "Cannot send to socket"
 
-// General pourpose buffer
-char commonBuffer[MAX_BUF_SIZE];
-
 typedef struct {
 	int measType;
 	int nProbes;
 	int msgSize;
 	int serverDelay;
+	int framing; // FRAMING_NEWLINE or FRAMING_LENGTH
+	int udpPort; // Client UDP port, 0 if the probes go over TCP
 } MeasurementConfig;
 
+// States of a session (see report/server-fsm.png)
+typedef enum {
+	STATE_HELLO,       // Waiting for the Hello message
+	STATE_MEASUREMENT, // Waiting for the probe with sequence number `nextSeqNumber`
+	STATE_DELAY,       // Waiting for the server delay before echoing a probe
+	STATE_SPLICE,      // Moving the payload of a large probe into the pipe
+	STATE_BYE,         // Waiting for the Bye message, or a Hello message starting a new measurement
+	                   // (also while echoing UDP probes)
+	STATE_CLOSING,     // Sending the last response, then closing
+	STATE_CLOSED       // Closed, freed at the end of the event loop iteration
+} SessionState;
+
+typedef enum {
+	EVENT_LISTEN,
+	EVENT_SOCKET,
+	EVENT_TIMER,
+	EVENT_DATAGRAM
+} EventType;
+
+typedef struct Session Session;
+typedef struct Reactor Reactor;
+
+// Registered with epoll: tells what became ready
+typedef struct {
+	EventType type;
+	Session *session;
+} EventSource;
+
+// UDP probes received together, then echoed together from the same buffers
+typedef struct {
+	struct mmsghdr received[DATAGRAM_BATCH_SIZE];
+	struct iovec buffers[DATAGRAM_BATCH_SIZE];
+	struct mmsghdr echoes[DATAGRAM_BATCH_SIZE];
+	struct iovec echoed[DATAGRAM_BATCH_SIZE];
+	char *data;
+} DatagramBatch;
+
+struct Session {
+	Reactor *reactor;
+	int socketFD;
+	int timerFD; // Server delay deadline, -1 if there is no delay
+	int pipeFDs[2]; // Large payloads are echoed through it, -1 if they are not
+	size_t spliceRemaining; // Payload bytes still to be moved into the pipe
+	size_t pipeLength; // Bytes of the probe in the pipe
+	int datagramFD; // Connected to the client UDP port, -1 if the probes go over TCP
+	DatagramBatch *datagrams;
+	unsigned long long datagramsEchoed;
+	unsigned long long datagramsDropped; // Not valid, or not accepted by the socket
+	EventSource socketEvent;
+	EventSource timerEvent;
+	EventSource datagramEvent;
+	SessionState state;
+	MeasurementConfig config;
+	int nextSeqNumber;
+	// Received data not parsed yet
+	FrameBuffer input;
+	// The first `echoLength` bytes of the input are a probe being echoed
+	size_t echoLength;
+	size_t echoSent;
+	// Data waiting for the socket to be writable
+	char *output;
+	size_t outputStart;
+	size_t outputEnd;
+	size_t outputCapacity;
+	uint32_t watchedEvents;
+	Session *nextClosed;
+};
+
+// A thread running its own event loop on its own SO_REUSEPORT listener:
+// sessions never move between reactors, so nothing is shared between threads
+struct Reactor {
+	pthread_t thread;
+	int id;
+	int epollFD;
+	int helloSocket;
+	EventSource listenEvent;
+	// Sessions closed during the current event loop iteration
+	Session *closedSessions;
+};
+
+// No log message for each probe (--quiet): at small payloads, writing them
+// takes longer than echoing the probes
+bool quiet = false;
+
 // Terminates the program with a custom error code
 void die(int error) {
 	switch(error) {
@@ -67,7 +174,7 @@ void die(int error) {
 			perror("The close operation returned an error");
 			break;
 		case EXIT_INVALID_PORT:
-			fprintf(stderr, "Usage: server PORT");
+			fprintf(stderr, "Usage: server [%s N] [%s] PORT\n", THREADS_OPTION, QUIET_OPTION);
 			break;
 		case EXIT_RECV_ERROR:
 			perror("Cannot read from socket");
@@ -75,6 +182,21 @@ void die(int error) {
 		case EXIT_MALLOC_ERROR:
 			perror("Cannot allocate memory");
 			break;
+		case EXIT_EPOLL_ERROR:
+			perror("The epoll operation returned an error");
+			break;
+		case EXIT_TIMER_ERROR:
+			perror("The timer operation returned an error");
+			break;
+		case EXIT_SOCKET_OPTION_ERROR:
+			perror("Cannot set the socket option");
+			break;
+		case EXIT_THREAD_ERROR:
+			perror("Cannot start the reactor thread");
+			break;
+		case EXIT_PIPE_ERROR:
+			perror("Cannot create the pipe");
+			break;
 	}
 	exit(error);
 }
@@ -82,12 +204,26 @@ void die(int error) {
 /* TRY- functions: wrappers to system calls with error checking */
 
 int try_create_tcp_socket(){
-	int socketFD = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	int socketFD = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
 	if(socketFD < 0)
 		die(EXIT_SOCKET_CREATION_ERROR);
 	return socketFD;
 }
 
+void try_enable_reuse_port(int socketFD) {
+	int value = 1;
+	if (setsockopt(socketFD, SOL_SOCKET, SO_REUSEPORT, &value, sizeof(value)) < 0)
+		die(EXIT_SOCKET_OPTION_ERROR);
+}
+
+// Echoes and responses are written whole: waiting to coalesce them with
+// later data (Nagle) would only delay them
+void try_disable_nagle(int socketFD) {
+	int value = 1;
+	if (setsockopt(socketFD, IPPROTO_TCP, TCP_NODELAY, &value, sizeof(value)) < 0)
+		die(EXIT_SOCKET_OPTION_ERROR);
+}
+
 void try_bind(int socketFD, struct sockaddr_in serverAddr){
 	if (bind(socketFD, (struct sockaddr*)&serverAddr, sizeof(serverAddr)) < 0)
 		die(EXIT_SOCKET_BIND_ERROR);
@@ -98,11 +234,19 @@ void try_listen(int socketFD){
 		die(EXIT_LISTEN_ERROR);
 }
 
+// Returns -1 if there is no connection to accept right now
 int try_accept(int socketFD, struct sockaddr_in* client_addr){
 	socklen_t size = sizeof(*client_addr);
-	int acceptResult = accept(socketFD, (struct sockaddr*)client_addr, &size);
-	if(acceptResult < 0)
+	int acceptResult = accept4(socketFD, (struct sockaddr*)client_addr, &size, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (acceptResult < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR || errno == ECONNABORTED)
+			return -1;
+		if (errno == EMFILE || errno == ENFILE) { // Keep serving the sessions already open
+			perror("Cannot accept connection");
+			return -1;
+		}
 		die(EXIT_ACCEPT_ERROR);
+	}
 	return acceptResult;
 }
 
@@ -112,21 +256,6 @@ void try_close(int socketFD) {
 	}
 }
 
-size_t try_recv(int socketFD, char* buffer) {
-	int readCount = recv(socketFD, buffer, MAX_BUF_SIZE, 0);
-	if (readCount < 0) {
-		die(EXIT_RECV_ERROR);
-	}
-	return readCount;
-}
-
-bool try_send(int socketFD, char* buffer, size_t len) {
-	int result = send(socketFD, buffer, len, MSG_NOSIGNAL);
-	if (result < 0)
-		perror(EXIT_SEND_ERROR_MSG);
-	return result >= 0;
-}
-
 void* try_malloc(size_t size) {
 	void* pointer = malloc(size);
 	if (pointer == NULL)
@@ -134,6 +263,62 @@ void* try_malloc(size_t size) {
 	return pointer;
 }
 
+void* try_realloc(void *pointer, size_t size) {
+	pointer = realloc(pointer, size);
+	if (pointer == NULL)
+		die(EXIT_MALLOC_ERROR);
+	return pointer;
+}
+
+int try_epoll_create() {
+	int result = epoll_create1(EPOLL_CLOEXEC);
+	if (result < 0)
+		die(EXIT_EPOLL_ERROR);
+	return result;
+}
+
+void try_epoll_ctl(int epollFD, int operation, int fd, uint32_t events, EventSource *source) {
+	struct epoll_event event;
+	event.events = events;
+	event.data.ptr = source;
+	if (epoll_ctl(epollFD, operation, fd, &event) < 0)
+		die(EXIT_EPOLL_ERROR);
+}
+
+// Returns the number of ready events, 0 if interrupted by a signal
+int try_epoll_wait(int epollFD, struct epoll_event *events, int maxEvents) {
+	int result = epoll_wait(epollFD, events, maxEvents, -1);
+	if (result < 0) {
+		if (errno == EINTR)
+			return 0;
+		die(EXIT_EPOLL_ERROR);
+	}
+	return result;
+}
+
+// Returns false on errors, leaving both descriptors at -1
+bool open_pipe(int pipeFDs[2]) {
+	if (pipe2(pipeFDs, O_NONBLOCK | O_CLOEXEC) == 0)
+		return true;
+	pipeFDs[0] = pipeFDs[1] = -1;
+	return false;
+}
+
+// Returns -1 on errors: they only concern the session asking for the timer
+int open_timer() {
+	return timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+}
+
+// Arms the timer to expire once after the given number of milliseconds
+void try_timerfd_start(int timerFD, long msec) {
+	struct itimerspec deadline;
+	memset(&deadline, 0, sizeof(deadline));
+	deadline.it_value.tv_sec = msec / 1000;
+	deadline.it_value.tv_nsec = (msec % 1000) * 1000000;
+	if (timerfd_settime(timerFD, 0, &deadline, NULL) < 0)
+		die(EXIT_TIMER_ERROR);
+}
+
 /* Utility functions */
 
 struct sockaddr_in get_server_address(int port) {
@@ -155,32 +340,6 @@ bool is_valid_port(char* s) {
 	return atoi(s) > 0 && atoi(s) <= PORT_MAX;
 }
 
-// Checks if a string ends with a newline
-bool ends_with_newline(char *s, size_t len) {
-	return len != 0 || s[len-1] != '\n';
-}
-
-// Sleeps for the given number of milliseconds
-// Got from https://stackoverflow.com/a/1157217
-int msleep(long msec) {
-	struct timespec ts;
-	int res;
-
-	if (msec < 0) {
-		errno = EINVAL;
-		return -1;
-	}
-
-	ts.tv_sec = msec / 1000;
-	ts.tv_nsec = (msec % 1000) * 1000000;
-
-	do {
-		res = nanosleep(&ts, &ts);
-	} while (res && errno == EINTR);
-
-	return res;
-}
-
 // Reads into *val an integer field at the beginning of the given string.
 // The fields ends with the given character `delim`.
 // Returns the first charater after the read int number, or NULL if the
@@ -201,29 +360,62 @@ char *read_int(char *s, char delim, int *val) {
 	return end;
 }
 
-// Reads from the socket until it finds a newline
-size_t receive_all_message(int socketFD, char *output) {
-	size_t len = 0, last_read;
-	do {
-		last_read = try_recv(socketFD, output+len);
-		len += last_read;
-	} while(last_read != 0 && output[len-1] != '\n');
-	return len;
+// Large probes are echoed without being copied to memory: only their header
+// is received, the payload goes from the socket to a pipe and back.
+// The probe is echoed only after it has been validated, like the ones in
+// memory, so the pipe must hold a whole probe. The payload itself is never
+// looked at, so only length framing is spliced: with newline framing a
+// newline inside the payload makes the probe invalid, and checking that
+// needs the payload in memory anyway.
+bool is_splice_enabled(Session *session) {
+	return session->pipeFDs[0] >= 0;
+}
+
+// Size of the longest message accepted in the given state
+size_t get_max_message_size(Session *session) {
+	if (session->state == STATE_MEASUREMENT && !is_splice_enabled(session))
+		return session->config.msgSize + FRAME_HEADER_MAX_SIZE;
+	return MAX_BUF_SIZE;
 }
 
-// Allocates the right amount of memory for a measurement message
-char* allocate_measurement_message(int msgSize) {
-	size_t totalSize = msgSize + MAX_INT_LENGTH + 10;
-	return (char*)try_malloc(totalSize);
+// Size of the input kept in the buffer: pipelined probes echoed from memory
+// are read ahead, so that many small ones are received with one read
+size_t get_max_input_size(Session *session) {
+	size_t maxSize = get_max_message_size(session);
+	if (session->state == STATE_MEASUREMENT && !is_splice_enabled(session))
+		return maxSize + READ_AHEAD_SIZE;
+	return maxSize;
 }
 
-// Returns false if there has been an error
-bool handle_hello_phase(int dataSocket, MeasurementConfig *conf) {
-	char *msg = commonBuffer;
-	size_t msgLen = receive_all_message(dataSocket, msg);
+/* Message parsing: `msg` is a whole message, newline included, followed by a '\0' */
 
-	if (!ends_with_newline(msg, msgLen))
-		return false;
+// Reads the options at the end of the Hello message: the framing (" len")
+// and the UDP port of the client (" udp <port>").
+// Returns false if they are not valid.
+bool parse_hello_options(char *start, MeasurementConfig *conf) {
+	while (true) {
+		char *end;
+		size_t len = strcspn(start, " \n");
+		if (len == strlen(FRAMING_LENGTH_KEYWORD) && strncmp(start, FRAMING_LENGTH_KEYWORD, len) == 0) {
+			conf->framing = FRAMING_LENGTH;
+			end = start + len;
+		} else if (len == strlen(UDP_KEYWORD) && strncmp(start, UDP_KEYWORD, len) == 0 && start[len] == ' ') {
+			end = read_int(start + len + 1, '\n', &conf->udpPort);
+			if (end == NULL)
+				end = read_int(start + len + 1, ' ', &conf->udpPort);
+			if (end == NULL || conf->udpPort <= 0 || conf->udpPort > PORT_MAX)
+				return false;
+		} else {
+			return false;
+		}
+		if (*end == '\n')
+			return end[1] == '\0';
+		start = end + 1;
+	}
+}
+
+// Returns false if the Hello message is not valid
+bool parse_hello_msg(char *msg, MeasurementConfig *conf) {
 	// Check if it's hello message
 	if (msg[0] != 'h' || msg[1] != ' ')
 		return false;
@@ -242,6 +434,7 @@ bool handle_hello_phase(int dataSocket, MeasurementConfig *conf) {
 		conf->measType = MEAS_THPUT_TYPE;
 	else
 		return false;
+	*end = ' ';
 
 	// Read number of probes
 	start = end + 1;
@@ -253,136 +446,789 @@ bool handle_hello_phase(int dataSocket, MeasurementConfig *conf) {
 	end = read_int(start, ' ', &conf->msgSize);
 	if (end == NULL)
 		return false;
-	// Read server delay
+	// Read server delay, optionally followed by the options
 	start = end + 1;
 	end = read_int(start, '\n', &conf->serverDelay);
-	if (end == NULL)
-		return false;
+	conf->framing = FRAMING_NEWLINE;
+	conf->udpPort = 0;
+	if (end == NULL) {
+		end = read_int(start, ' ', &conf->serverDelay);
+		if (end == NULL || !parse_hello_options(end + 1, conf))
+			return false;
+	}
+	if (conf->udpPort > 0 && (conf->serverDelay > 0 ||
+		conf->msgSize > UDP_MAX_DATAGRAM - (int)sizeof(UdpProbeHeader)))
+		return false; // UDP probes are echoed at once, in a single datagram
 
-	return true;
+	return conf->nProbes > 0 && conf->msgSize > 0;
 }
 
-// Returns false if there has been an error
-bool parse_measurement_msg(char *msg, int *seqNumber, char **payload) {
-	if (!ends_with_newline(msg, strlen(msg)))
-		return false;
-	// Check if it's measurement message
-	if (msg[0] != 'm' || msg[1] != ' ')
-		return false;
+/* Sessions */
 
-	char *start, *end;
-	start = msg+2;
-	end = read_int(start, ' ', seqNumber);
-	if (end == NULL)
-		return false;
+// Checks if there is a validated probe (in the input buffer or in the pipe) still to be sent
+bool is_echo_pending(Session *session) {
+	return (session->echoLength > 0 || session->pipeLength > 0) && session->state != STATE_DELAY &&
+		session->state != STATE_SPLICE;
+}
 
-	*payload = end + 1;
-	start[strlen(start)-1] = 0; // Remove last newline
+// Starts or stops watching the socket for input and output
+void update_watched_events(Session *session) {
+	uint32_t events;
+	if (session->outputStart < session->outputEnd || is_echo_pending(session))
+		events = EPOLLOUT; // Do not read more until the previous output has been sent
+	else if (session->state == STATE_DELAY || session->state == STATE_CLOSING)
+		events = 0;
+	else
+		events = EPOLLIN;
+	if (events != session->watchedEvents) {
+		try_epoll_ctl(session->reactor->epollFD, EPOLL_CTL_MOD, session->socketFD, events, &session->socketEvent);
+		session->watchedEvents = events;
+	}
+}
 
-	return true;
+void close_session(Session *session) {
+	if (session->state == STATE_CLOSED)
+		return;
+	try_close(session->socketFD); // Also removes it from epoll
+	if (session->timerFD >= 0)
+		try_close(session->timerFD);
+	if (is_splice_enabled(session)) {
+		try_close(session->pipeFDs[0]);
+		try_close(session->pipeFDs[1]);
+	}
+	if (session->datagramFD >= 0)
+		try_close(session->datagramFD);
+	session->state = STATE_CLOSED;
+	session->nextClosed = session->reactor->closedSessions;
+	session->reactor->closedSessions = session;
+	printf("Connection closed\n");
 }
 
-// Returns false if there has been an error
-bool handle_measurement_phase(int dataSocket, MeasurementConfig config) {
-	char *payloadBuffer = allocate_measurement_message(config.msgSize);
-	char *originalMsg = allocate_measurement_message(config.msgSize);
-
-	bool isOk = true;
-	for (int i = 1; isOk && i <= config.nProbes; i++) {
-		int msgLen = receive_all_message(dataSocket, payloadBuffer);
-		payloadBuffer[msgLen] = '\0';
-		strcpy(originalMsg, payloadBuffer);
-		int seqNumber;
-		char *payload;
-		// Check for any error
-		if (!parse_measurement_msg(payloadBuffer, &seqNumber, &payload) || seqNumber != i || strlen(payload) != config.msgSize) {
-			printf("Received wrong Measurement message\n");
-			isOk = false;
-			break;
+// Frees the sessions closed during the last event loop iteration
+void free_closed_sessions(Reactor *reactor) {
+	while (reactor->closedSessions != NULL) {
+		Session *session = reactor->closedSessions;
+		reactor->closedSessions = session->nextClosed;
+		frame_buffer_free(&session->input);
+		free(session->output);
+		if (session->datagrams != NULL)
+			free(session->datagrams->data);
+		free(session->datagrams);
+		free(session);
+	}
+}
+
+// Sends as much pending output as possible; closes the session on errors
+// and after the last response. Returns false if the session was closed.
+bool flush_output(Session *session) {
+	while (session->outputStart < session->outputEnd) {
+		ssize_t sent = send(session->socketFD, session->output + session->outputStart,
+			session->outputEnd - session->outputStart, MSG_NOSIGNAL);
+		if (sent < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			if (errno == EINTR)
+				continue;
+			perror(EXIT_SEND_ERROR_MSG);
+			close_session(session);
+			return false;
+		}
+		session->outputStart += sent;
+	}
+	if (session->outputStart == session->outputEnd) {
+		session->outputStart = session->outputEnd = 0;
+		if (session->state == STATE_CLOSING) {
+			close_session(session);
+			return false;
 		}
-		printf("Received correct Measurement message with sequence number %d\n", seqNumber);
-		msleep(config.serverDelay);
-		isOk = try_send(dataSocket, originalMsg, strlen(originalMsg));
-		printf("Echoed back Measurement message\n");
 	}
-	free(payloadBuffer);
-	free(originalMsg);
-	return isOk;
+	return true;
 }
 
-// Returns false if there has been an error
-bool handle_bye_phase(int dataSocket) {
-	size_t len = receive_all_message(dataSocket, commonBuffer);
-	return len == 2 && commonBuffer[0] == 'b' && commonBuffer[1] == '\n';
+void queue_output(Session *session, const char *data, size_t len) {
+	if (session->outputEnd + len > session->outputCapacity) {
+		session->outputCapacity = session->outputEnd + len;
+		session->output = (char*)try_realloc(session->output, session->outputCapacity);
+	}
+	memcpy(session->output + session->outputEnd, data, len);
+	session->outputEnd += len;
 }
 
-// Handles the communication with a client
-void handle_communication(int dataSocket) {
-	MeasurementConfig config;
+// Queues the last response of a session
+void queue_final_response(Session *session, const char *response) {
+	queue_output(session, response, strlen(response));
+	session->state = STATE_CLOSING;
+}
 
-	// Handle Hello Phase errors and log messages
-	if (handle_hello_phase(dataSocket, &config)) {
-		const char *measType = config.measType == MEAS_RTT_TYPE ? "RTT" : "Throughput";
-		printf("Received correct Hello message: measuring %s with %d probes of size %d, server delay of %dms\n",
-			measType, config.nProbes, config.msgSize, config.serverDelay);
-		if (!try_send(dataSocket, HELLO_OK_RESP, strlen(HELLO_OK_RESP)))
-			return;
-		printf("Sent OK response: %s", HELLO_OK_RESP);
-	} else {
+// Opens a UDP socket bound to `localAddr` and connected to `peerAddr`.
+// Returns -1 on errors: they only concern the session asking for it.
+int open_datagram_socket(struct sockaddr_in localAddr, struct sockaddr_in peerAddr) {
+	int socketFD = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_UDP);
+	if (socketFD < 0)
+		return -1;
+	if (bind(socketFD, (struct sockaddr*)&localAddr, sizeof(localAddr)) < 0 ||
+		connect(socketFD, (struct sockaddr*)&peerAddr, sizeof(peerAddr)) < 0) {
+		close(socketFD);
+		return -1;
+	}
+	return socketFD;
+}
+
+// Opens the UDP socket of the session, on the same address as the TCP one,
+// and connects it to the client UDP port: the kernel drops other datagrams.
+// Returns the local UDP port, -1 if the socket cannot be opened.
+int start_datagram_echo(Session *session) {
+	struct sockaddr_in localAddr, clientAddr;
+	socklen_t addrLen = sizeof(localAddr);
+	getsockname(session->socketFD, (struct sockaddr*)&localAddr, &addrLen);
+	addrLen = sizeof(clientAddr);
+	getpeername(session->socketFD, (struct sockaddr*)&clientAddr, &addrLen);
+	localAddr.sin_port = 0;
+	clientAddr.sin_port = htons(session->config.udpPort);
+
+	session->datagramFD = open_datagram_socket(localAddr, clientAddr);
+	if (session->datagramFD < 0) {
+		perror("Cannot open the UDP socket of the session");
+		return -1;
+	}
+	addrLen = sizeof(localAddr);
+	getsockname(session->datagramFD, (struct sockaddr*)&localAddr, &addrLen);
+
+	// One more byte for each datagram, so that longer ones are noticed
+	size_t slotSize = sizeof(UdpProbeHeader) + session->config.msgSize + 1;
+	DatagramBatch *batch = (DatagramBatch*)try_malloc(sizeof(DatagramBatch));
+	memset(batch, 0, sizeof(DatagramBatch));
+	batch->data = (char*)try_malloc(DATAGRAM_BATCH_SIZE * slotSize);
+	for (int i = 0; i < DATAGRAM_BATCH_SIZE; i++) {
+		batch->buffers[i].iov_base = batch->data + i * slotSize;
+		batch->buffers[i].iov_len = slotSize;
+		batch->received[i].msg_hdr.msg_iov = &batch->buffers[i];
+		batch->received[i].msg_hdr.msg_iovlen = 1;
+		batch->echoes[i].msg_hdr.msg_iov = &batch->echoed[i];
+		batch->echoes[i].msg_hdr.msg_iovlen = 1;
+	}
+	session->datagrams = batch;
+	try_epoll_ctl(session->reactor->epollFD, EPOLL_CTL_ADD, session->datagramFD, EPOLLIN, &session->datagramEvent);
+	return ntohs(localAddr.sin_port);
+}
+
+void handle_hello_msg(Session *session, char *msg) {
+	MeasurementConfig *config = &session->config;
+	if (!parse_hello_msg(msg, config)) {
 		printf("Received wrong Hello message\n");
-		try_send(dataSocket, HELLO_ERROR_RESP, strlen(HELLO_ERROR_RESP));
+		queue_final_response(session, HELLO_ERROR_RESP);
 		printf("Sent error response: %s", HELLO_ERROR_RESP);
 		return;
 	}
-
-	// Handle Measurement Phase errors and log messages
-	if (!handle_measurement_phase(dataSocket, config)) {
-		try_send(dataSocket, MEASUREMENT_ERROR_RESP, strlen(MEASUREMENT_ERROR_RESP));
-		printf("Sent error response: %s", MEASUREMENT_ERROR_RESP);
+	const char *measType = config->measType == MEAS_RTT_TYPE ? "RTT" : "Throughput";
+	const char *framing = config->framing == FRAMING_LENGTH ? "length framing" : "newline framing";
+	printf("Received correct Hello message: measuring %s with %d probes of size %d, server delay of %dms, %s\n",
+		measType, config->nProbes, config->msgSize, config->serverDelay, config->udpPort > 0 ? "over UDP" : framing);
+	if (config->udpPort > 0) {
+		// The probes do not go over this connection: only the Bye message is left
+		int udpPort = start_datagram_echo(session);
+		if (udpPort < 0) {
+			queue_final_response(session, HELLO_ERROR_RESP);
+			printf("Sent error response: %s", HELLO_ERROR_RESP);
+			return;
+		}
+		char response[MAX_BUF_SIZE];
+		sprintf(response, HELLO_UDP_OK_RESP, udpPort);
+		queue_output(session, response, strlen(response));
+		printf("Sent OK response: %s", response);
+		session->state = STATE_BYE;
 		return;
 	}
+	if (config->serverDelay > 0) {
+		session->timerFD = open_timer();
+		if (session->timerFD < 0) {
+			perror("Cannot create the timer of the session");
+			queue_final_response(session, HELLO_ERROR_RESP);
+			printf("Sent error response: %s", HELLO_ERROR_RESP);
+			return;
+		}
+		try_epoll_ctl(session->reactor->epollFD, EPOLL_CTL_ADD, session->timerFD, EPOLLIN, &session->timerEvent);
+	}
+	queue_output(session, HELLO_OK_RESP, strlen(HELLO_OK_RESP));
+	printf("Sent OK response: %s", HELLO_OK_RESP);
+	session->state = STATE_MEASUREMENT;
+	session->nextSeqNumber = 1;
+	// Splicing is only an optimisation: without a pipe the probes are echoed from memory
+	if (config->serverDelay == 0 && config->msgSize >= SPLICE_MIN_PAYLOAD && config->framing == FRAMING_LENGTH &&
+		open_pipe(session->pipeFDs)) {
+		int pipeSize = fcntl(session->pipeFDs[1], F_SETPIPE_SZ, config->msgSize + FRAME_HEADER_MAX_SIZE);
+		if (pipeSize < config->msgSize + FRAME_HEADER_MAX_SIZE) { // Over the pipe size limit: echo from memory
+			try_close(session->pipeFDs[0]);
+			try_close(session->pipeFDs[1]);
+			session->pipeFDs[0] = session->pipeFDs[1] = -1;
+		}
+	}
+}
+
+// Moves to the next probe once the current one has been echoed
+void finish_probe(Session *session) {
+	if (!quiet)
+		printf("Echoed back Measurement message\n");
+	session->nextSeqNumber++;
+	session->state = session->nextSeqNumber > session->config.nProbes ? STATE_BYE : STATE_MEASUREMENT;
+}
+
+// Echoes the probe which is the first message in the input buffer: it is
+// sent from there and removed once sent
+void echo_probe(Session *session, size_t len) {
+	session->echoLength = len;
+	session->echoSent = 0;
+	finish_probe(session);
+}
+
+void send_measurement_error(Session *session) {
+	printf("Received wrong Measurement message\n");
+	queue_final_response(session, MEASUREMENT_ERROR_RESP);
+	printf("Sent error response: %s", MEASUREMENT_ERROR_RESP);
+}
+
+// Parses the header of the first probe in the input buffer: "m <seq> " with
+// newline framing, "m <seq> <len>\n" with length framing (only then
+// *payloadLen is set). Returns the length of the header, 0 if it is not
+// complete yet, -1 if it is not valid.
+ssize_t read_probe_header(Session *session, int *seqNumber, size_t *payloadLen) {
+	if (session->config.framing == FRAMING_LENGTH)
+		return frame_buffer_probe_header(&session->input, seqNumber, payloadLen);
+	char header[MAX_INT_LENGTH + 4];
+	size_t len = session->input.length < sizeof(header) - 1 ? session->input.length : sizeof(header) - 1;
+	frame_buffer_copy(&session->input, 0, len, header);
+	header[len] = '\0';
+	size_t headerLen = 0;
+	bool valid = len < 2 || (header[0] == 'm' && header[1] == ' ');
+	for (size_t i = 2; valid && i < len && headerLen == 0; i++) {
+		if (header[i] == ' ' && i > 2)
+			headerLen = i + 1;
+		else
+			valid = isdigit(header[i]) && i < 2 + MAX_INT_LENGTH;
+	}
+	if (!valid)
+		return -1;
+	if (headerLen == 0)
+		return 0;
+	header[headerLen - 1] = '\0';
+	*seqNumber = atoi(header + 2);
+	return headerLen;
+}
+
+// Handles the first probe in the input buffer, if it is complete: echoes it
+// when valid, unless it has to wait for the server delay.
+// Returns false if it is not complete yet.
+bool handle_measurement_msg(Session *session) {
+	int seqNumber = 0;
+	size_t payloadLen = 0, frameLen = 0;
+	ssize_t headerLen;
+	if (session->config.framing == FRAMING_NEWLINE) {
+		size_t lineLen = frame_buffer_find_line(&session->input);
+		if (lineLen == 0 && session->input.length < get_max_message_size(session))
+			return false;
+		headerLen = lineLen == 0 ? -1 : read_probe_header(session, &seqNumber, &payloadLen); // Too long
+		if (headerLen > 0) {
+			payloadLen = lineLen - headerLen - 1; // Without the last newline
+			frameLen = lineLen;
+		} else {
+			headerLen = -1;
+		}
+	} else {
+		headerLen = read_probe_header(session, &seqNumber, &payloadLen);
+		if (headerLen == 0)
+			return false;
+		frameLen = headerLen + payloadLen;
+	}
+	if (headerLen < 0 || seqNumber != session->nextSeqNumber || payloadLen != (size_t)session->config.msgSize) {
+		send_measurement_error(session);
+		return true;
+	}
+	if (session->input.length < frameLen)
+		return false; // The payload is not complete yet (length framing)
+	if (!quiet)
+		printf("Received correct Measurement message with sequence number %d\n", seqNumber);
+	if (session->config.serverDelay > 0) {
+		try_timerfd_start(session->timerFD, session->config.serverDelay);
+		session->echoLength = frameLen;
+		session->echoSent = 0;
+		session->state = STATE_DELAY;
+		return true;
+	}
+	echo_probe(session, frameLen);
+	return true;
+}
+
+// Called when the whole payload is in the pipe
+void end_spliced_payload(Session *session) {
+	if (!quiet)
+		printf("Received correct Measurement message with sequence number %d\n", session->nextSeqNumber);
+	finish_probe(session);
+}
+
+// Validates in place the header of the first probe in the input buffer and
+// starts moving the probe into the pipe: the header and the part of the
+// payload already received are written, the rest is spliced.
+// Returns false if the header is not complete yet.
+bool handle_probe_header(Session *session) {
+	int seqNumber = 0;
+	size_t payloadLen = session->config.msgSize;
+	ssize_t headerLen = read_probe_header(session, &seqNumber, &payloadLen);
+	if (headerLen == 0)
+		return false;
+	if (headerLen < 0 || seqNumber != session->nextSeqNumber || payloadLen != (size_t)session->config.msgSize) {
+		send_measurement_error(session);
+		return true;
+	}
+	size_t received = session->input.length - headerLen;
+	if (received > payloadLen)
+		received = payloadLen;
+	// The pipe is empty and can hold the whole probe
+	struct iovec regions[2];
+	int count = frame_buffer_regions(&session->input, 0, headerLen + received, regions);
+	ssize_t written = writev(session->pipeFDs[1], regions, count);
+	if (written != (ssize_t)(headerLen + received)) {
+		perror("Cannot write to the pipe");
+		close_session(session);
+		return true;
+	}
+	frame_buffer_consume(&session->input, written);
+	session->pipeLength = written;
+	session->spliceRemaining = payloadLen - received;
+	session->state = STATE_SPLICE;
+	if (session->spliceRemaining == 0)
+		end_spliced_payload(session);
+	return true;
+}
+
+// Checks if the pipe has no room left, even if it holds fewer bytes than its
+// size: every splice takes at least one of its page-sized slots
+bool is_pipe_full(Session *session) {
+	struct pollfd pipeEnd = { session->pipeFDs[1], POLLOUT, 0 };
+	return poll(&pipeEnd, 1, 0) == 0;
+}
+
+// Moves the probe in the pipe back to the beginning of the input buffer
+// and echoes the next probes from memory
+void stop_splicing(Session *session) {
+	size_t len = session->pipeLength;
+	if (!frame_buffer_prepend(&session->input, len))
+		die(EXIT_MALLOC_ERROR);
+	struct iovec regions[2];
+	int count = frame_buffer_regions(&session->input, 0, len, regions);
+	for (int i = 0; i < count; i++) {
+		for (size_t done = 0; done < regions[i].iov_len; ) {
+			ssize_t readCount = read(session->pipeFDs[0], (char*)regions[i].iov_base + done, regions[i].iov_len - done);
+			if (readCount <= 0)
+				die(EXIT_PIPE_ERROR);
+			done += readCount;
+		}
+	}
+	try_close(session->pipeFDs[0]);
+	try_close(session->pipeFDs[1]);
+	session->pipeFDs[0] = session->pipeFDs[1] = -1;
+	session->pipeLength = session->spliceRemaining = 0;
+	session->state = STATE_MEASUREMENT;
+	printf("Pipe full, echoing from memory\n");
+}
 
-	// Handle Bye Phase errors and log messages
-	if (handle_bye_phase(dataSocket)) {
+// Moves the payload from the socket into the pipe.
+// Returns false if the session was closed.
+bool receive_payload(Session *session) {
+	while (session->spliceRemaining > 0) {
+		ssize_t moved = splice(session->socketFD, NULL, session->pipeFDs[1], NULL, session->spliceRemaining,
+			SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (moved < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				if (is_pipe_full(session))
+					stop_splicing(session);
+				return true;
+			}
+			if (errno == EINTR)
+				continue;
+			perror("Cannot read from socket");
+		}
+		if (moved <= 0) { // Error or connection closed by the client
+			close_session(session);
+			return false;
+		}
+		session->spliceRemaining -= moved;
+		session->pipeLength += moved;
+	}
+	end_spliced_payload(session);
+	return true;
+}
+
+// Sends the echoed probe from the input buffer or from the pipe.
+// Returns false if the session was closed.
+bool send_echo(Session *session) {
+	while (session->echoSent < session->echoLength) {
+		struct msghdr msg;
+		struct iovec regions[2];
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = regions;
+		msg.msg_iovlen = frame_buffer_regions(&session->input, session->echoSent,
+			session->echoLength - session->echoSent, regions);
+		ssize_t sent = sendmsg(session->socketFD, &msg, MSG_NOSIGNAL);
+		if (sent < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			if (errno == EINTR)
+				continue;
+			perror(EXIT_SEND_ERROR_MSG);
+			close_session(session);
+			return false;
+		}
+		session->echoSent += sent;
+	}
+	if (session->echoLength > 0 && session->echoSent == session->echoLength) {
+		frame_buffer_consume(&session->input, session->echoLength);
+		session->echoLength = session->echoSent = 0;
+	}
+	while (session->pipeLength > 0) {
+		ssize_t moved = splice(session->pipeFDs[0], NULL, session->socketFD, NULL, session->pipeLength,
+			SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (moved < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			if (errno == EINTR)
+				continue;
+			perror(EXIT_SEND_ERROR_MSG);
+			close_session(session);
+			return false;
+		}
+		session->pipeLength -= moved;
+	}
+	return true;
+}
+
+// Releases what the measurement used, before a new one or the Bye response
+void end_measurement(Session *session) {
+	if (session->datagramFD >= 0) {
+		printf("Echoed %llu UDP probes, dropped %llu\n", session->datagramsEchoed, session->datagramsDropped);
+		try_close(session->datagramFD);
+		session->datagramFD = -1;
+		free(session->datagrams->data);
+		free(session->datagrams);
+		session->datagrams = NULL;
+		session->datagramsEchoed = session->datagramsDropped = 0;
+	}
+	if (session->timerFD >= 0) {
+		try_close(session->timerFD);
+		session->timerFD = -1;
+	}
+	if (is_splice_enabled(session)) {
+		try_close(session->pipeFDs[0]);
+		try_close(session->pipeFDs[1]);
+		session->pipeFDs[0] = session->pipeFDs[1] = -1;
+	}
+}
+
+void handle_bye_msg(Session *session, char *msg, size_t len) {
+	end_measurement(session);
+	if (len == 2 && msg[0] == 'b' && msg[1] == '\n') {
 		printf("Received correct Bye message\n");
-		try_send(dataSocket, BYE_OK_RESP, strlen(BYE_OK_RESP));
+		queue_final_response(session, BYE_OK_RESP);
 		printf("Sent OK response: %s", BYE_OK_RESP);
-		return;
 	} else {
 		printf("Received wrong Bye message\n");
-		try_send(dataSocket, BYE_ERROR_RESP, strlen(BYE_ERROR_RESP));
+		queue_final_response(session, BYE_ERROR_RESP);
 		printf("Sent error response: %s", BYE_ERROR_RESP);
+	}
+}
+
+// Sends the pending output, then the echoed probe, and updates the events
+// to watch. Returns false if the session was closed.
+bool send_pending(Session *session) {
+	if (session->state == STATE_CLOSED || !flush_output(session))
+		return false;
+	if (is_echo_pending(session) && session->outputEnd == 0 && !send_echo(session))
+		return false;
+	update_watched_events(session);
+	return true;
+}
+
+// Handles the first message in the input buffer.
+// Returns false if it is not complete yet.
+bool handle_next_message(Session *session) {
+	if (session->state == STATE_MEASUREMENT)
+		return is_splice_enabled(session) ? handle_probe_header(session) : handle_measurement_msg(session);
+
+	char msg[MAX_BUF_SIZE + 1];
+	size_t len = frame_buffer_find_line(&session->input);
+	if (len == 0 && session->input.length < MAX_BUF_SIZE)
+		return false;
+	if (len == 0 || len > MAX_BUF_SIZE) { // Too long
+		msg[0] = '\0'; // Parsed as an invalid message
+		len = 0;
+	} else {
+		frame_buffer_copy(&session->input, 0, len, msg);
+		msg[len] = '\0';
+		frame_buffer_consume(&session->input, len);
+	}
+	if (session->state == STATE_HELLO) {
+		handle_hello_msg(session, msg);
+	} else if (msg[0] == 'h') { // A new measurement in the same session (like a sweep of sizes)
+		end_measurement(session);
+		handle_hello_msg(session, msg);
+	} else {
+		handle_bye_msg(session, msg, len);
+	}
+	return true;
+}
+
+// Handles the complete messages in the input buffer, one at a time:
+// a message is handled only after the responses to the previous ones are sent
+void process_input(Session *session) {
+	if (!send_pending(session))
 		return;
+	while ((session->state == STATE_HELLO || session->state == STATE_MEASUREMENT ||
+		session->state == STATE_BYE) &&
+		session->outputEnd == 0 && !is_echo_pending(session)) {
+		if (!handle_next_message(session) || !send_pending(session))
+			return;
 	}
 }
 
-int main(int argc, char** argv) {
-	// Read and check port parameter
-	if (argc != 2 || !is_valid_port(argv[1])) {
-		die(EXIT_INVALID_PORT);
+// Reads what is available on the socket; returns false if the session was closed
+bool receive_input(Session *session) {
+	size_t maxSize = get_max_input_size(session);
+	while (true) {
+		ssize_t readCount = frame_buffer_receive(&session->input, session->socketFD, maxSize);
+		if (readCount < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS)
+				return true; // ENOBUFS: whole messages are there, or a message too long
+			if (errno == EINTR)
+				continue;
+			if (errno == ENOMEM)
+				die(EXIT_MALLOC_ERROR);
+			perror("Cannot read from socket");
+		}
+		if (readCount <= 0) { // Error or connection closed by the client
+			close_session(session);
+			return false;
+		}
 	}
-	int port = atoi(argv[1]);
+}
 
-	// Create the TCP socket to accept connections
-	int helloSocket = try_create_tcp_socket();
-	try_bind(helloSocket, get_server_address(port));
-	try_listen(helloSocket);
+void handle_timer(Session *session) {
+	uint64_t expirations;
+	if (read(session->timerFD, &expirations, sizeof(expirations)) < 0 || session->state != STATE_DELAY)
+		return;
+	// The delayed probe is still the first message in the input buffer
+	finish_probe(session);
+	process_input(session);
+}
 
-	// Loop forever
-	while(true) {
-		// Accept a new connection
-		struct sockaddr_in client_addr;
-		int dataSocket = try_accept(helloSocket, &client_addr);
+// Returns the monotonic clock in nanoseconds
+uint64_t get_time_ns() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+// Checks that a received datagram is a UDP probe of the session
+bool is_valid_datagram(Session *session, struct mmsghdr *datagram) {
+	UdpProbeHeader *header = (UdpProbeHeader*)datagram->msg_hdr.msg_iov->iov_base;
+	return datagram->msg_len == sizeof(UdpProbeHeader) + session->config.msgSize &&
+		ntohl(header->magic) == UDP_PROBE_MAGIC;
+}
+
+// Receives the UDP probes in batches and echoes the valid ones, stamped
+// with the time they were received. An echo the socket cannot take is
+// dropped, like any datagram. The probes left after a few batches are
+// handled at the next wakeup (the socket is level-triggered).
+void handle_datagrams(Session *session) {
+	DatagramBatch *batch = session->datagrams;
+	int count;
+	int batches = 0;
+	if (session->datagramFD < 0)
+		return; // Closed by a Bye or Hello message in the same event loop iteration
+	do {
+		count = recvmmsg(session->datagramFD, batch->received, DATAGRAM_BATCH_SIZE, 0, NULL);
+		if (count < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				perror("Cannot receive UDP probes");
+			return;
+		}
+		uint64_t echoTime = htobe64(get_time_ns());
+		int echoCount = 0;
+		for (int i = 0; i < count; i++) {
+			if (!is_valid_datagram(session, &batch->received[i])) {
+				session->datagramsDropped++;
+				continue;
+			}
+			((UdpProbeHeader*)batch->buffers[i].iov_base)->echoTime = echoTime;
+			batch->echoed[echoCount].iov_base = batch->buffers[i].iov_base;
+			batch->echoed[echoCount].iov_len = batch->received[i].msg_len;
+			echoCount++;
+		}
+		int sent = 0;
+		while (sent < echoCount) {
+			int res = sendmmsg(session->datagramFD, batch->echoes + sent, echoCount - sent, 0);
+			if (res < 0 && errno == EINTR)
+				continue;
+			if (res <= 0)
+				break;
+			sent += res;
+		}
+		session->datagramsEchoed += sent;
+		session->datagramsDropped += echoCount - sent;
+	} while (count == DATAGRAM_BATCH_SIZE && ++batches < DATAGRAM_BATCHES_PER_WAKEUP); // Probably more waiting
+}
 
+void handle_socket(Session *session, uint32_t events) {
+	if (events & EPOLLOUT) {
+		process_input(session); // Also handles the messages received while waiting for the output
+		return;
+	}
+	if ((events & (EPOLLERR | EPOLLHUP)) && session->watchedEvents != EPOLLIN) {
+		close_session(session); // Reported even when not watched
+		return;
+	}
+	if ((events & (EPOLLIN | EPOLLERR | EPOLLHUP)) && session->watchedEvents == EPOLLIN) {
+		if (session->state == STATE_SPLICE ? receive_payload(session) : receive_input(session))
+			process_input(session);
+	}
+}
+
+void start_session(Reactor *reactor, int dataSocket) {
+	Session *session = (Session*)try_malloc(sizeof(Session));
+	memset(session, 0, sizeof(Session));
+	session->reactor = reactor;
+	session->socketFD = dataSocket;
+	try_disable_nagle(dataSocket);
+	session->timerFD = -1;
+	session->pipeFDs[0] = session->pipeFDs[1] = -1;
+	session->datagramFD = -1;
+	session->socketEvent.type = EVENT_SOCKET;
+	session->socketEvent.session = session;
+	session->timerEvent.type = EVENT_TIMER;
+	session->timerEvent.session = session;
+	session->datagramEvent.type = EVENT_DATAGRAM;
+	session->datagramEvent.session = session;
+	session->state = STATE_HELLO;
+	if (!frame_buffer_init(&session->input))
+		die(EXIT_MALLOC_ERROR);
+	session->watchedEvents = EPOLLIN;
+	try_epoll_ctl(reactor->epollFD, EPOLL_CTL_ADD, dataSocket, EPOLLIN, &session->socketEvent);
+}
+
+// Accepts all the pending connections
+void accept_connections(Reactor *reactor) {
+	struct sockaddr_in client_addr;
+	char address[INET_ADDRSTRLEN];
+	int dataSocket;
+	while ((dataSocket = try_accept(reactor->helloSocket, &client_addr)) >= 0) {
 		// Print client info
-		inet_ntop(AF_INET, &client_addr.sin_addr, commonBuffer, INET_ADDRSTRLEN);
-		printf("Client connected: %s:%d\n", commonBuffer, client_addr.sin_port);
+		inet_ntop(AF_INET, &client_addr.sin_addr, address, INET_ADDRSTRLEN);
+		printf("Client connected: %s:%d\n", address, ntohs(client_addr.sin_port));
+		start_session(reactor, dataSocket);
+	}
+}
+
+// Runs the event loop of a reactor: every session is a state machine
+// driven by the events of its sockets and timer
+void *run_reactor(void *arg) {
+	Reactor *reactor = (Reactor*)arg;
+	struct epoll_event events[MAX_EVENTS];
+	while(true) {
+		int count = try_epoll_wait(reactor->epollFD, events, MAX_EVENTS);
+		for (int i = 0; i < count; i++) {
+			EventSource *source = (EventSource*)events[i].data.ptr;
+			if (source->type == EVENT_LISTEN)
+				accept_connections(reactor);
+			else if (source->session->state == STATE_CLOSED)
+				continue; // Closed by a previous event
+			else if (source->type == EVENT_SOCKET)
+				handle_socket(source->session, events[i].events);
+			else if (source->type == EVENT_DATAGRAM)
+				handle_datagrams(source->session);
+			else
+				handle_timer(source->session);
+		}
+		free_closed_sessions(reactor);
+	}
+	return NULL;
+}
+
+// Creates the listener and the epoll instance of a reactor. All the listeners
+// are bound before any thread starts, so a busy port is reported at once.
+void initialize_reactor(Reactor *reactor, int id, int port) {
+	reactor->id = id;
+	reactor->closedSessions = NULL;
+	reactor->helloSocket = try_create_tcp_socket();
+	try_enable_reuse_port(reactor->helloSocket);
+	try_bind(reactor->helloSocket, get_server_address(port));
+	try_listen(reactor->helloSocket);
+	reactor->epollFD = try_epoll_create();
+	reactor->listenEvent.type = EVENT_LISTEN;
+	reactor->listenEvent.session = NULL;
+	try_epoll_ctl(reactor->epollFD, EPOLL_CTL_ADD, reactor->helloSocket, EPOLLIN, &reactor->listenEvent);
+}
 
-		// Handle the measurement
-		handle_communication(dataSocket);
+// Pins the reactor thread to a CPU (round robin), so that the kernel delivers
+// the connections of a listener to the core which serves them
+void pin_reactor(Reactor *reactor) {
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpus <= 0)
+		return;
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(reactor->id % cpus, &set);
+	pthread_setaffinity_np(reactor->thread, sizeof(set), &set); // Best effort
+}
+
+void start_reactor(Reactor *reactor) {
+	errno = pthread_create(&reactor->thread, NULL, run_reactor, reactor);
+	if (errno != 0)
+		die(EXIT_THREAD_ERROR);
+	pin_reactor(reactor);
+}
+
+// Reads the number of reactor threads from the command line (1 if not given)
+int read_threads_option(char *value) {
+	for (char *c = value; *c != '\0'; c++) {
+		if (!isdigit(*c))
+			die(EXIT_INVALID_PORT);
+	}
+	int threads = atoi(value);
+	if (threads <= 0 || threads > MAX_THREADS)
+		die(EXIT_INVALID_PORT);
+	return threads;
+}
+
+// Reads the options before the port: "--threads N" and "--quiet".
+// Returns the number of threads.
+int read_options(int argc, char **argv) {
+	int threads = 1;
+	for (int i = 1; i < argc - 1; i++) {
+		if (strcmp(argv[i], QUIET_OPTION) == 0)
+			quiet = true;
+		else if (strcmp(argv[i], THREADS_OPTION) == 0 && i + 1 < argc - 1)
+			threads = read_threads_option(argv[++i]);
+		else
+			die(EXIT_INVALID_PORT);
+	}
+	return threads;
+}
 
-		// Close the connection (if the communication was either successful or failed)
-		try_close(dataSocket);
-		printf("Connection closed\n");
+int main(int argc, char** argv) {
+	// Read and check parameters
+	int threads = read_options(argc, argv);
+	if (argc < 2 || !is_valid_port(argv[argc - 1])) {
+		die(EXIT_INVALID_PORT);
 	}
+	int port = atoi(argv[argc - 1]);
+
+	Reactor *reactors = (Reactor*)try_malloc(threads * sizeof(Reactor));
+	for (int i = 0; i < threads; i++)
+		initialize_reactor(&reactors[i], i, port);
+
+	// The main thread runs the first reactor
+	for (int i = 1; i < threads; i++)
+		start_reactor(&reactors[i]);
+	reactors[0].thread = pthread_self();
+	if (threads > 1)
+		pin_reactor(&reactors[0]);
+	run_reactor(&reactors[0]);
 }